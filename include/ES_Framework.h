@@ -21,11 +21,28 @@
 //#include "stdint.h"
 #include <inttypes.h>
 
+// EventType is held in 16 bits rather than the 4 byte enum so that the
+// default ES_Event packs into one 4 byte word. Define ES_WIDE_EVENT_PARAM in
+// ES_Configure.h for a 32 bit EventParam, which makes an ES_Event 8 bytes.
+#ifdef ES_WIDE_EVENT_PARAM
+typedef uint32_t ES_EventParam_t;
+#else
+typedef uint16_t ES_EventParam_t;
+#endif
+
 typedef struct ES_Event_t {
-    ES_EventTyp_t EventType;    // what kind of event?
-    uint16_t   EventParam;      // parameter value for use w/ this event
+    uint16_t EventType;         // what kind of event? one of ES_EventTyp_t
+    ES_EventParam_t EventParam; // parameter value for use w/ this event
 }ES_Event;
 
+// compile time checks, an array of negative size is an error
+typedef char ES_EventTypeFits[(NUMBEROFEVENTS <= 0x10000) ? 1 : -1];
+#ifdef ES_WIDE_EVENT_PARAM
+typedef char ES_EventIsTwoWords[(sizeof(ES_Event) == 8) ? 1 : -1];
+#else
+typedef char ES_EventIsOneWord[(sizeof(ES_Event) == 4) ? 1 : -1];
+#endif
+
 #define INIT_EVENT  (ES_Event){ES_INIT,0x0000}
 #define ENTRY_EVENT (ES_Event){ES_ENTRY,0x0000}
 #define EXIT_EVENT  (ES_Event){ES_EXIT,0x0000}
@@ -63,23 +80,60 @@ typedef struct ES_Event_t {
 #ifndef ES_Timers_H
 #define ES_Timers_H
 
+// returned in place of a time when nothing is scheduled
+#define ES_NO_DEADLINE 0xFFFFFFFFUL
+
+// returned by ES_Timer_Alloc when every timer is taken
+#define ES_TIMER_NO_HANDLE 0xFF
+
 
 
 typedef enum { ES_Timer_ERR           = -1,
                ES_Timer_ACTIVE        =  1,
                ES_Timer_OK            =  0,
-               ES_Timer_NOT_ACTIVE    =  0
+               ES_Timer_NOT_ACTIVE    =  0,
+               ES_Timer_EXPIRED       =  1,
+               ES_Timer_NOT_EXPIRED   =  0
 } ES_TimerReturn_t;
 
+// how the timeouts of one timer have been delivered, kept with USE_TIMER_STATS
+typedef struct {
+    uint32_t Period;    // milliseconds between timeouts, 0 for a one shot
+    uint32_t Timeouts;  // times it timed out
+    uint32_t Handled;   // timeouts that reached a run function
+    uint32_t Skipped;   // periods that went by before the interrupt saw them
+    uint32_t Stale;     // timeouts dropped because it had been restarted
+    uint32_t WorstLate; // longest from due to a run function, microseconds
+} ES_TimerStats_t;
+
 
 /**
  * @Function ES_Timer_Init(void)
  * @param none
  * @return None.
- * @brief  Initializes the timer module
+ * @brief  Initializes the timer module. It is called by ES_Initialize and by
+ * TIMERS_Init, and only does anything the first time.
  * @author Max Dunne, 2011.11.15 */
 void             ES_Timer_Init(void);
 
+/**
+ * @Function ES_Timer_Alloc(pPostFunc PostFunc)
+ * @param PostFunc - the post function for the timer's events
+ * @return the number of a timer that was TIMER_UNUSED, now bound to PostFunc,
+ * or ES_TIMER_NO_HANDLE if there are none left
+ * @brief  hands out a timer at run time, so that a module can have one
+ * without a number of its own in ES_Configure.h. Call it from an init
+ * function, the timers are never given back. */
+uint8_t          ES_Timer_Alloc(uint8_t (*PostFunc)(ES_Event));
+
+/**
+ * @Function ES_Timer_NoPost(ES_Event ThisEvent)
+ * @param ThisEvent - a timer event
+ * @return TRUE
+ * @brief  the post function for a timer that is only polled, with
+ * ES_Timer_IsTimerExpired. The interrupt posts nothing for such a timer. */
+uint8_t          ES_Timer_NoPost(ES_Event ThisEvent);
+
 /**
  * @Function ES_Timer_InitTimer(uint8_t Num, uint32_t NewTime)
  * @param Num -  the number of the timer to start
@@ -90,12 +144,27 @@ void             ES_Timer_Init(void);
  * @author Max Dunne 2011.11.15 */
 ES_TimerReturn_t ES_Timer_InitTimer(uint8_t Num, uint32_t NewTime);
 
+/**
+ * @Function ES_Timer_InitPeriodicTimer(uint8_t Num, uint32_t Period)
+ * @param Num -  the number of the timer to start
+ * @param Period - the number of milliseconds between timeouts
+ * @return ERROR or SUCCESS
+ * @brief  starts the timer timing out every Period milliseconds until it is
+ * stopped or given a one shot time with ES_Timer_InitTimer. Each timeout is
+ * due Period after the last one was due, not after it was handled, so the
+ * time it takes to get to a run function does not add up, a slow run
+ * function only makes the timeouts late. A period that has gone by entirely
+ * before the interrupt got to it is skipped, not posted, which can only
+ * happen with USE_TICKLESS_TIMERS and interrupts held off for over a period. */
+ES_TimerReturn_t ES_Timer_InitPeriodicTimer(uint8_t Num, uint32_t Period);
+
 /**
  * @Function ES_Timer_SetTimer(uint8_t Num, uint32_t NewTime)
  * @param Num - the number of the timer to set.
  * @param NewTime -  the number of milliseconds to be counted
  * @return ERROR or SUCCESS
- * @brief  sets the time for a timer, but does not make it active.
+ * @brief  sets the time for a timer, but does not make it active. A timer
+ * that is already running carries on with the new time.
  * @author Max Dunne  2011.11.15 */
 ES_TimerReturn_t ES_Timer_SetTimer(uint8_t Num, uint32_t NewTime);
 
@@ -103,7 +172,8 @@ ES_TimerReturn_t ES_Timer_SetTimer(uint8_t Num, uint32_t NewTime);
  * @Function ES_Timer_StartTimer(uint8_t Num)
  * @param Num - the number of the timer to start
  * @return ERROR or SUCCESS
- * @brief  simply sets the active flag in TMR_ActiveFlags to resart a stopped timer.
+ * @brief  restarts a stopped timer with the time it had left, a periodic one
+ * then carries on with its period
  * @author Max Dunne, 2011.11.15 */
 ES_TimerReturn_t ES_Timer_StartTimer(uint8_t Num);
 
@@ -111,20 +181,129 @@ ES_TimerReturn_t ES_Timer_StartTimer(uint8_t Num);
  * @Function ES_Timer_StopTimer(unsigned char Num)
  * @param Num - the number of the timer to stop.
  * @return ERROR or SUCCESS
- * @brief  simply clears the bit in TimerActiveFlags associated with this timer. This
- * will cause it to stop counting.
+ * @brief  takes the timer out of the running list, keeping the time it had
+ * left so that ES_Timer_StartTimer can carry on from there. A timeout it
+ * posted while it was running is dropped before it reaches a run function,
+ * one it had already timed out with is not.
  * @author Max Dunne 2011.11.15 */
 ES_TimerReturn_t ES_Timer_StopTimer(uint8_t Num);
 
+/**
+ * @Function ES_Timer_IsTimerActive(uint8_t Num)
+ * @param Num - the number of the timer to check
+ * @return ERROR, ES_Timer_ACTIVE or ES_Timer_NOT_ACTIVE
+ * @brief  whether the timer is counting */
+ES_TimerReturn_t ES_Timer_IsTimerActive(uint8_t Num);
+
+/**
+ * @Function ES_Timer_IsTimerExpired(uint8_t Num)
+ * @param Num - the number of the timer to check
+ * @return ERROR, ES_Timer_EXPIRED or ES_Timer_NOT_EXPIRED
+ * @brief  whether the timer has timed out since it was last started with
+ * ES_Timer_InitTimer or cleared with ES_Timer_ClearTimerExpired. For timers
+ * that are polled rather than waited on with ES_TIMEOUT. */
+ES_TimerReturn_t ES_Timer_IsTimerExpired(uint8_t Num);
+
+/**
+ * @Function ES_Timer_ClearTimerExpired(uint8_t Num)
+ * @param Num - the timer whose expired flag should be cleared
+ * @return ERROR or SUCCESS
+ * @brief  shows that the timeout has been dealt with */
+ES_TimerReturn_t ES_Timer_ClearTimerExpired(uint8_t Num);
+
+/**
+ * @Function ES_Timer_GetTimerState(uint8_t Num)
+ * @param Num - the number of the timer to check
+ * @return ES_TIMERACTIVE while it is counting, ES_TIMEOUT once it has timed
+ * out, ES_TIMERSTOPPED if it was stopped with time left, and ES_NO_EVENT if
+ * it has never been started or is not a timer
+ * @brief  the state a service used to follow from ES_TIMERACTIVE and
+ * ES_TIMERSTOPPED, read straight from the timer */
+ES_EventTyp_t    ES_Timer_GetTimerState(uint8_t Num);
+
+/**
+ * @Function ES_Timer_GetTimeLeft(uint8_t Num)
+ * @param Num - the number of the timer to check
+ * @return milliseconds until a running timer times out, or that a stopped
+ * one will count once it is started again, 0 once it has timed out
+ * @brief  works for any timer, unlike ES_Timer_GetTimeToExpiry which gives
+ * the soonest */
+uint32_t         ES_Timer_GetTimeLeft(uint8_t Num);
+
 /**
  * Function: ES_Timer_GetTime(void)
  * @param None
  * @return FreeRunningTimer - the current value of the module variable FreeRunningTimer
  * @remark Provides the ability to grab a snapshot time as an alternative to using
  * the library timers. Can be used to determine how long between 2 events.
+ * For finer times, or ones that must not wrap, use ES_ReadTimestamp.
  * @author Max Dunne, 2011.11.15  */
 uint32_t         ES_Timer_GetTime(void);
 
+/**
+ * Function: ES_Timer_GetTimeToExpiry(void)
+ * @param None
+ * @return milliseconds until the next active timer times out, ES_NO_DEADLINE
+ * if no timer is running
+ * @remark used by ES_Run to decide how long it may sleep */
+uint32_t         ES_Timer_GetTimeToExpiry(void);
+
+/**
+ * Function: ES_Timer_WakeWithin(uint32_t Ms)
+ * @param Ms - the longest ES_Run may sleep, ES_NO_DEADLINE for no limit
+ * @return None
+ * @remark called by ES_Run just before it waits for an interrupt, so that one
+ * comes when the next event checker is due even if no timer is. Only needed
+ * with USE_TICKLESS_TIMERS, the 1ms tick wakes it otherwise. The wake up
+ * posts nothing and is forgotten once it has gone by */
+void             ES_Timer_WakeWithin(uint32_t Ms);
+
+/**
+ * Function: ES_Timer_Handled(uint8_t Num)
+ * @param Num - the EventParam of an ES_TIMEOUT that is about to be handled
+ * @return None
+ * @remark called by ES_Run as it hands an ES_TIMEOUT to a run function. The
+ * time since the timeout was due goes into the timer's lateness counters.
+ * Only the first run function to get a timeout counts. Does nothing without
+ * USE_TIMER_STATS */
+void             ES_Timer_Handled(uint8_t Num);
+
+/**
+ * Function: ES_Timer_CheckTimeout(ES_Event *pThisEvent)
+ * @param pThisEvent - an ES_TIMEOUT just taken from a queue
+ * @return FALSE if it is stale and must be dropped, otherwise TRUE
+ * @remark called by ES_Run before an ES_TIMEOUT gets to a run function. A
+ * timeout from an earlier arm of its timer, one that was restarted or
+ * stopped after the timeout was posted, is stale and counted. Otherwise the
+ * generation is taken off so that EventParam is just the timer number, and
+ * the timeout goes to ES_Timer_Handled. Only timeouts the timer interrupt
+ * posted carry a generation, marked by bit 15 of EventParam, which is
+ * reserved for it. An ES_TIMEOUT posted by hand must leave that bit clear
+ * and is always taken as it is. */
+uint8_t          ES_Timer_CheckTimeout(ES_Event *pThisEvent);
+
+/**
+ * Function: ES_Timer_GetStaleTimeouts(void)
+ * @param None
+ * @return the number of ES_TIMEOUTs dropped by ES_Timer_CheckTimeout
+ * @remark with USE_TIMER_STATS each timer's Stale counter has its share */
+uint16_t         ES_Timer_GetStaleTimeouts(void);
+
+/**
+ * Function: ES_Timer_GetStats(uint8_t Num, ES_TimerStats_t *pStats)
+ * @param Num - the number of the timer
+ * @param pStats - where to put its counters
+ * @return ERROR if there is no such timer, otherwise SUCCESS
+ * @remark the counters are all zero unless USE_TIMER_STATS is defined */
+ES_TimerReturn_t ES_Timer_GetStats(uint8_t Num, ES_TimerStats_t *pStats);
+
+/**
+ * Function: ES_Timer_ResetStats(void)
+ * @param None
+ * @return None
+ * @remark zeroes the counters of every timer */
+void             ES_Timer_ResetStats(void);
+
 #endif   /* ES_Timers_H */
 /*------------------------------ End of file ------------------------------*/
 
@@ -154,7 +333,20 @@ typedef uint8_t CheckFunc( void );
 
 typedef CheckFunc (*pCheckFunc);
 
+// NUM_EVENT_CHECKERS counts the entries in EVENT_CHECK_LIST, usable in #if
+#define EVENT_CHECK_COUNT_FORM(FUNC, PERIOD, READY) +1
+#define NUM_EVENT_CHECKERS (0 EVENT_CHECK_LIST(EVENT_CHECK_COUNT_FORM))
+
+// counters kept for each event checker, to see how often it is worth calling
+typedef struct {
+    const char *Name;   // the checker's function name
+    uint32_t Calls;     // times it was called
+    uint32_t Hits;      // times it found an event
+} ES_CheckerStats_t;
+
 uint8_t ES_CheckUserEvents( void );
+uint8_t ES_GetCheckerStats( uint8_t WhichChecker, ES_CheckerStats_t * pStats );
+uint32_t ES_CheckerIdleTime( void );
 
 
 #endif  // ES_CheckEvents_H
@@ -218,6 +410,15 @@ ES_Event RunKeyboardInput(ES_Event ThisEvent);
  * @author Max Dunne, 2013.09.26 */
 void KeyboardInput_PrintEvents(void);
 
+/**
+ * @Function KeyboardInput_PrintQueues(void)
+ * @param None
+ * @return None
+ * @brief  Lists the queue counters of every service, see ES_GetQueueStats,
+ *         their run function times, see ES_GetRunStats, and the event
+ *         checker counters, see ES_GetCheckerStats. */
+void KeyboardInput_PrintQueues(void);
+
 
 
 #endif	/* ES_KEYBOARDINPUT_H */
@@ -273,10 +474,36 @@ extern uint8_t const Byte2MSBitNum[255];
 
 // these macros provide the wrappers for critical regions, where ints will be off
 // but the state of the interrupt enable prior to entry will be restored.
-extern unsigned char _CCR_temp;
+// They must be used as a pair in the same block, EnterCritical saves the CP0
+// Status register in a local that ExitCritical writes back.
 
-#define EnterCritical()     
-#define ExitCritical()      
+#define EnterCritical()     { uint32_t _CCR_temp = __builtin_disable_interrupts();
+#define ExitCritical()      __builtin_mtc0(12, 0, _CCR_temp); }
+
+// a free running 32 bit clock for timing run functions. On the PIC32 it is
+// the CP0 Count register, which counts at SYSCLK/2. Built anywhere else, for
+// testing on a host, it is the monotonic clock scaled to the same rate.
+#define ES_RUN_CLOCK_TICKS_PER_US 40
+
+#ifdef __PIC32MX__
+#include <xc.h>
+#define ES_ReadRunClock() ((uint32_t) _CP0_GET_COUNT())
+#else
+#include <time.h>
+static inline uint32_t ES_ReadRunClock(void) {
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (uint32_t) Now.tv_sec * (ES_RUN_CLOCK_TICKS_PER_US * 1000000UL) +
+            (uint32_t) Now.tv_nsec / (1000 / ES_RUN_CLOCK_TICKS_PER_US);
+}
+#endif
+
+// the same clock carried on into 64 bits, so that it never wraps. Use it for
+// anything stored, and ES_ReadRunClock for short intervals. It can be called
+// from interrupts. It has to be read at least once per wrap of the 32 bit
+// clock, every 107s, which the ES timer interrupt does.
+uint64_t ES_ReadTimestamp(void);
+#define ES_TIMESTAMP_TO_US(Stamp) ((Stamp) / ES_RUN_CLOCK_TICKS_PER_US)
 
 
 #endif
@@ -347,65 +574,162 @@ uint8_t GetSetMask( uint8_t BitNum );
 
 
 #include <inttypes.h>
+
+/* queues hold a power of two number of entries, at most 128. Use
+   ES_QUEUE_BLOCK_SIZE(n) to size an array of ES_Event that holds at least n
+   entries plus the queue header */
+#define ES_QUEUE_POW2(n) ((n) <= 1 ? 1 : (n) <= 2 ? 2 : (n) <= 4 ? 4 : \
+                          (n) <= 8 ? 8 : (n) <= 16 ? 16 : (n) <= 32 ? 32 : \
+                          (n) <= 64 ? 64 : 128)
+#define ES_QUEUE_BLOCK_SIZE(n) (ES_QUEUE_POW2(n) + 1)
+
 /* prototypes for public functions */
 
 uint8_t ES_InitQueue( ES_Event * pBlock, unsigned char BlockSize );
 uint8_t ES_EnQueueFIFO( ES_Event * pBlock, ES_Event Event2Add );
+uint8_t ES_EnQueueFIFOMulti( ES_Event * pBlock, ES_Event Event2Add );
+uint8_t ES_EnQueueLIFO( ES_Event * pBlock, ES_Event Event2Add );
 uint8_t ES_DeQueue( ES_Event * pBlock, ES_Event * pReturnEvent );
+uint8_t ES_DeQueueLIFO( ES_Event * pBlock, ES_Event * pReturnEvent );
 //void EF_FlushQueue( unsigned char * pBlock );
 uint8_t ES_IsQueueEmpty( ES_Event * pBlock );
+uint8_t ES_QueueCount( ES_Event * pBlock );
+uint8_t ES_QueueRoom( ES_Event * pBlock );
+uint8_t ES_QueueNextEntry( ES_Event * pBlock );
+uint8_t ES_QueueNextOut( ES_Event * pBlock );
+uint8_t ES_CoalesceQueued( ES_Event * pBlock, uint8_t Entry, ES_Event NewEvent );
 
 #endif /*ES_Queue_H */
 
 
 /****************************************************************************
  Module
-     ES_ServiceHeaders.h
+     ES_Payload.h
  Description
-     This file serves to keep the clutter down in ES_Framework.h
+     header file for the pools of payload blocks that carry data too big for
+     EventParam
  Notes
- History
- When           Who     What/Why
- -------------- ---     --------
- 01/15/12 10:35 jec      started coding
+     the pools are PAYLOAD_POOLS in ES_Configure.h, the events that carry a
+     payload handle in EventParam are PAYLOAD_EVENTS
 *****************************************************************************/
+#ifndef ES_Payload_H
+#define ES_Payload_H
 
+#include <inttypes.h>
 
-#ifdef DEV
-#include SERV_0_HEADER
-#endif
-
-#if NUM_SERVICES > 1
-#ifdef DEV
-#include SERV_1_HEADER
+// PAYLOAD_POOLS and PAYLOAD_EVENTS in ES_Configure.h are optional
+#ifndef PAYLOAD_POOLS
+#define PAYLOAD_POOLS(POOL)
 #endif
+#ifndef PAYLOAD_EVENTS
+#define PAYLOAD_EVENTS(EVENT)
 #endif
 
+// NUM_PAYLOAD_POOLS counts the entries in PAYLOAD_POOLS, usable in #if
+#define PAYLOAD_COUNT_FORM(SIZE, COUNT) +1
+#define NUM_PAYLOAD_POOLS (0 PAYLOAD_POOLS(PAYLOAD_COUNT_FORM))
 
-#if NUM_SERVICES > 2
-#include SERV_2_HEADER
+#if NUM_PAYLOAD_POOLS > 8
+#error PAYLOAD_POOLS can have at most 8 entries
 #endif
 
-#if NUM_SERVICES > 3
-#include SERV_3_HEADER
-#endif
+// a handle is the pool number in the high byte and the block in the low byte
+#define ES_NO_PAYLOAD 0xFFFF
 
-#if NUM_SERVICES > 4
-#include SERV_4_HEADER
-#endif
+/* prototypes for public functions */
 
-#if NUM_SERVICES > 5
-#include SERV_5_HEADER
-#endif
+void ES_InitPayloads( void );
+uint16_t ES_PayloadAlloc( uint16_t Size );
+void * ES_PayloadPtr( uint16_t Handle );
+void ES_PayloadRetain( uint16_t Handle );
+void ES_PayloadRelease( uint16_t Handle );
+uint8_t ES_IsPayloadEvent( ES_Event ThisEvent );
 
-#if NUM_SERVICES > 6
-#include SERV_6_HEADER
-#endif
+#endif /*ES_Payload_H */
+
+
+/****************************************************************************
+ Module
+     ES_HSM.h
+ Description
+     header file for the table driven hierarchical state machine engine
+ Notes
+     a machine is an array of ES_HSMState_t indexed by state number, each
+     entry naming its handler, its parent and the child entered when it is
+     the target of a transition. Handlers return ES_NO_EVENT to consume an
+     event and call ES_HSM_Transition to change state.
+*****************************************************************************/
+#ifndef ES_HSM_H
+#define ES_HSM_H
+
+#include <inttypes.h>
+
+// the Parent of a top level state and the InitialChild of a leaf
+#define ES_HSM_NO_STATE 0xFF
+
+struct ES_HSM;
+typedef ES_Event ES_HSMHandler_t(struct ES_HSM *pMachine, ES_Event ThisEvent);
+
+typedef struct {
+    ES_HSMHandler_t *Handler;
+    uint8_t Parent;
+    uint8_t InitialChild;
+} ES_HSMState_t;
 
-#if NUM_SERVICES > 7
-#include SERV_7_HEADER
+typedef struct ES_HSM {
+    const ES_HSMState_t *pStates; // the table, indexed by state number
+    uint8_t Current; // the leaf state the machine is in
+    uint8_t Target; // set by ES_HSM_Transition while an event is handled
+    uint8_t Started; // FALSE until the transition out of the pseudo-state
+} ES_HSM_t;
+
+/* prototypes for public functions */
+
+void ES_HSM_Init(ES_HSM_t *pMachine, const ES_HSMState_t *pStates,
+        uint8_t Initial);
+ES_Event ES_HSM_Dispatch(ES_HSM_t *pMachine, ES_Event ThisEvent);
+void ES_HSM_Transition(ES_HSM_t *pMachine, uint8_t Target);
+uint8_t ES_HSM_GetState(const ES_HSM_t *pMachine);
+uint8_t ES_HSM_IsInState(const ES_HSM_t *pMachine, uint8_t State);
+
+#endif /*ES_HSM_H */
+
+
+/****************************************************************************
+ Module
+     ES_ServiceHeaders.h
+ Description
+     This file serves to keep the clutter down in ES_Framework.h
+ Notes
+     the prototypes for every service's Init, Run and Post functions are
+     generated from SERVICE_LIST in ES_Configure.h, so the service headers
+     no longer need to be named there
+ History
+ When           Who     What/Why
+ -------------- ---     --------
+ 01/15/12 10:35 jec      started coding
+*****************************************************************************/
+#ifndef ES_ServiceHeaders_H
+#define ES_ServiceHeaders_H
+
+#define SERVICE_PROTOTYPE_FORM(INIT, RUN, POST, QUEUE_SIZE, BATCH, BUDGET) \
+    uint8_t INIT(uint8_t Priority); \
+    ES_Event RUN(ES_Event ThisEvent); \
+    uint8_t POST(ES_Event ThisEvent);
+SERVICE_LIST(SERVICE_PROTOTYPE_FORM)
+
+// NUM_SERVICES counts the entries in SERVICE_LIST, and is still usable in #if
+#define SERVICE_COUNT_FORM(INIT, RUN, POST, QUEUE_SIZE, BATCH, BUDGET) +1
+#define NUM_SERVICES (0 SERVICE_LIST(SERVICE_COUNT_FORM))
+
+#if MAX_NUM_SERVICES > 32
+#error MAX_NUM_SERVICES can not be more than 32, the width of Ready
+#endif
+#if NUM_SERVICES > MAX_NUM_SERVICES
+#error SERVICE_LIST has more than MAX_NUM_SERVICES entries
 #endif
 
+#endif // ES_ServiceHeaders_H
 
 
 #ifndef ES_TattleTale_H
@@ -516,28 +840,28 @@ ES_Event RunTimerService( ES_Event ThisEvent );
 
 
 /**
- * @Function IsTimerActive(unsigned char Num)
+ * @Function IsUserTimerActive(unsigned char Num)
  * @param Num - the number of the timer to check
  * @return ERROR or TRUE or FALSE
  * @brief  used to determine if a timer is currently active.
  * @author Max Dunne   2013.01.04 */
-int8_t IsTimerActive(unsigned char Num);
+int8_t IsUserTimerActive(unsigned char Num);
 
 /**
- * @Function IsTimerExpired(unsigned char Num)
+ * @Function IsUserTimerExpired(unsigned char Num)
  * @param Num - the number of the timer to check
  * @return ERROR or TRUE or FALSE
  * @brief  used to determine if a timer is currently expired.
  * @author Max Dunne   2013.01.04 */
-int8_t IsTimerExpired(unsigned char Num);
+int8_t IsUserTimerExpired(unsigned char Num);
 
 /**
- * @Function IsTimerStopped(unsigned char Num)
+ * @Function IsUserTimerStopped(unsigned char Num)
  * @param Num - the number of the timer to check
  * @return ERROR or TRUE or FALSE
  * @brief  used to determine if a timer is currently stopped.
  * @author Max Dunne   2013.01.04 */
-int8_t IsTimerStopped(unsigned char Num);
+int8_t IsUserTimerStopped(unsigned char Num);
 
 /**
  * @Function GetUserTimerState(unsigned char Num)
@@ -573,6 +897,28 @@ ES_EventTyp_t GetUserTimerState(unsigned char Num);
 
 #define ARRAY_SIZE(x)  (sizeof(x)/sizeof(x[0]))
 
+// COALESCED_EVENTS in ES_Configure.h is optional
+#ifndef COALESCED_EVENTS
+#define COALESCED_EVENTS(EVENT)
+#endif
+
+// NUM_COALESCED_EVENTS counts the entries in COALESCED_EVENTS, usable in #if
+#define COALESCED_COUNT_FORM(EVENT) +1
+#define NUM_COALESCED_EVENTS (0 COALESCED_EVENTS(COALESCED_COUNT_FORM))
+
+#if NUM_COALESCED_EVENTS > 32
+#error COALESCED_EVENTS can have at most 32 entries, one per bit of a pending mask
+#endif
+
+// SUBSCRIPTIONS in ES_Configure.h is optional
+#ifndef SUBSCRIPTIONS
+#define SUBSCRIPTIONS(SUBSCRIBE)
+#endif
+
+// NUM_SUBSCRIPTIONS counts the entries in SUBSCRIPTIONS, usable in #if
+#define SUBSCRIPTION_COUNT_FORM(EVENT, POST) +1
+#define NUM_SUBSCRIPTIONS (0 SUBSCRIPTIONS(SUBSCRIPTION_COUNT_FORM))
+
 typedef enum {
               Success = 0,
               FailedPost = 1,
@@ -589,6 +935,64 @@ ES_Return_t ES_Run( void );
 uint8_t ES_PostAll( ES_Event ThisEvent );
 uint8_t ES_PostToService( uint8_t WhichService, ES_Event ThisEvent);
 
+// ES_PostFromISR is for interrupts. With USE_ISR_POST_RING it only puts the
+// event and its post function in a ring, and ES_Run makes the call later.
+uint8_t ES_PostFromISR( pPostFunc PostFunc, ES_Event ThisEvent );
+
+// ES_Publish posts to every service subscribed to the event's type, straight
+// into their queues. SUBSCRIPTIONS in ES_Configure.h sets who is subscribed
+// at start up, services can change it at run time.
+uint8_t ES_Publish( ES_Event ThisEvent );
+uint8_t ES_Subscribe( uint8_t WhichService, ES_EventTyp_t EventType );
+uint8_t ES_Unsubscribe( uint8_t WhichService, ES_EventTyp_t EventType );
+
+// counters kept for each service's queue, use them to size QueueSize in
+// SERVICE_LIST from what the queues actually see
+typedef struct {
+    uint8_t Depth;      // entries in the queue right now
+    uint8_t Capacity;   // entries the queue can hold
+    uint8_t Peak;       // most entries ever in the queue at once
+    uint16_t Dropped;   // posts refused because the queue was full
+    uint16_t Coalesced; // posts merged into an event already waiting
+    uint32_t Posted;    // posts accepted
+} ES_QueueStats_t;
+
+uint8_t ES_GetQueueStats( uint8_t WhichService, ES_QueueStats_t * pStats );
+void ES_ResetQueueStats( void );
+// ES_PostAll and ES_Publish that were refused because a target was full
+uint16_t ES_GetMulticastFailures( void );
+// ES_PostFromISR calls refused because the ring was full
+uint16_t ES_GetIsrPostsDropped( void );
+
+// time spent in each service's run function, kept with USE_RUN_BUDGETS
+// against the Budget in SERVICE_LIST
+typedef struct {
+    uint32_t Budget;    // microseconds allowed per call, 0 for no limit
+    uint32_t Worst;     // longest call in microseconds
+    uint32_t Overruns;  // calls that took longer than Budget
+    uint32_t Runs;      // calls timed
+} ES_RunStats_t;
+
+uint8_t ES_GetRunStats( uint8_t WhichService, ES_RunStats_t * pStats );
+void ES_ResetRunStats( void );
+
+// how often ES_Run went idle with USE_IDLE_WAIT, and how long it took to
+// get from an interrupt's post back to dispatching, in ES_ReadRunClock ticks
+typedef struct {
+    uint32_t Sleeps;        // times it waited for an interrupt
+    uint32_t Wakes;         // waits ended by a post
+    uint32_t WorstWake;     // longest post to dispatch after a wait
+    uint32_t AverageWake;   // mean post to dispatch after a wait
+} ES_IdleStats_t;
+
+void ES_GetIdleStats( ES_IdleStats_t * pStats );
+
+// a state that can not handle an event yet can park it in a deferral queue,
+// an array of ES_QUEUE_BLOCK_SIZE(n) events set up with ES_InitQueue, and
+// put it back at the front of its own queue later, usually on ES_EXIT
+uint8_t ES_DeferEvent( ES_Event * pDeferQueue, ES_Event ThisEvent );
+uint8_t ES_RecallEvents( uint8_t WhichService, ES_Event * pDeferQueue );
+
 
 
 #endif   // ES_Framework_H
@@ -5,7 +5,8 @@
  * Software module to enable a bank of software timers with a resolution time of
  * one msecond for each. The timers can be individually started, stopped, expired, etc.
  *
- * NOTE: Module uses TIMER5 for its interrupts.
+ * NOTE: Module runs on the ES_Framework timers and takes 16 of them with
+ * ES_Timer_Alloc in TIMERS_Init, so it has no hardware timer of its own.
  *
  * TIMERS_TEST (in the .c file) conditionally compiles the test harness for the code. 
  * Make sure it is commented out for module useage.
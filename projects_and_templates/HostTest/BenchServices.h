@@ -0,0 +1,38 @@
+/*
+ * File: BenchServices.h
+ *
+ * The SERVICE_LIST of the dispatch benchmarks in ES_Framework.c, which take
+ * the place of this directory's one TimerService when a benchmark is built,
+ * see ES_Configure.h and the Makefile's bench targets. Every benchmark runs
+ * 8 services of its own.
+ */
+
+#ifndef BENCH_SERVICES_H
+#define BENCH_SERVICES_H
+
+#ifdef ES_RUN_BENCHMARK
+#define BENCH_SERVICE(SERVICE) \
+    SERVICE(InitBenchService, RunBenchService, PostBenchService, 3, 1, 0)
+#endif
+
+#ifdef ES_RUN_BATCH_BENCHMARK
+// the Makefile builds it once with a Batch of 1 and once with a bigger one
+#ifndef BENCH_BATCH
+#define BENCH_BATCH 1
+#endif
+#define BENCH_SERVICE(SERVICE) \
+    SERVICE(InitBenchService, RunBenchService, PostBenchService, 16, BENCH_BATCH, 0)
+#endif
+
+#ifdef ES_PREEMPT_BENCHMARK
+#define BENCH_SERVICE(SERVICE) \
+    SERVICE(InitPreemptService, RunPreemptService, PostPreemptService, 4, 1, 0)
+#endif
+
+#define SERVICE_LIST(SERVICE) \
+    BENCH_SERVICE(SERVICE) BENCH_SERVICE(SERVICE) \
+    BENCH_SERVICE(SERVICE) BENCH_SERVICE(SERVICE) \
+    BENCH_SERVICE(SERVICE) BENCH_SERVICE(SERVICE) \
+    BENCH_SERVICE(SERVICE) BENCH_SERVICE(SERVICE)
+
+#endif /* BENCH_SERVICES_H */
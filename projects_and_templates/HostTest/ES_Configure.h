@@ -0,0 +1,261 @@
+/****************************************************************************
+ Module
+     ES_Configure.h
+ Description
+     This file contains macro definitions that are edited by the user to
+     adapt the Events and Services framework to a particular application.
+ Notes
+     the configuration for the host builds of the framework's test harnesses
+     in this directory, see the Makefile. One service, or the benchmarks'
+     own, no keyboard input, and the timers posting straight from their
+     interrupt.
+ History
+ When           Who     What/Why
+ -------------- ---     --------
+ 01/15/12 10:03 jec      started coding
+ *****************************************************************************/
+
+#ifndef CONFIGURE_H
+#define CONFIGURE_H
+
+
+
+//defines for keyboard input
+//#define USE_KEYBOARD_INPUT
+//What State machine are we testing
+#define POSTFUNCTION_FOR_KEYBOARD_INPUT PostTimerService
+
+//define for TattleTale
+//#define USE_TATTLETALE
+
+//uncomment to supress the entry and exit events
+//#define SUPPRESS_EXIT_ENTRY_IN_TATTLE
+
+//uncomment for a 32 bit EventParam, doubling the size of every ES_Event
+//#define ES_WIDE_EVENT_PARAM
+
+//define to time every run function against its Budget in SERVICE_LIST
+#define USE_RUN_BUDGETS
+//uncomment to have an ES_OVERRUN event posted when a run function goes over
+//#define RUN_OVERRUN_POST_FUNC PostKeyboardInput
+
+//define to idle the CPU while there are no events and no checker is due
+#define USE_IDLE_WAIT
+
+//define to run the ES timers from the core timer compare, which interrupts
+//only when a timer is due rather than every millisecond, leaving Timer1 free
+//#define USE_TICKLESS_TIMERS
+
+//define to count each timer's timeouts and how late they reach a run function
+#define USE_TIMER_STATS
+
+//define to have interrupts post through a ring that ES_Run empties into the
+//service queues, rather than call post functions from the interrupt
+//#define USE_ISR_POST_RING
+//entries in the ring, a power of two no bigger than 128
+#define ISR_POST_RING_SIZE 32
+
+//define to stop the timers posting ES_TIMERACTIVE and ES_TIMERSTOPPED as they
+//are started and stopped, ES_Timer_GetTimerState reads the state instead
+#define SUPPRESS_TIMER_STATE_EVENTS
+
+//uncomment to let a post to a higher priority service preempt the run
+//function that is executing, rather than wait for it to return
+//#define USE_PREEMPTION
+
+/****************************************************************************/
+// Name/define the events of interest
+// Universal events occupy the lowest entries, followed by user-defined events
+/****************************************************************************/
+//This section lists the names of your events as macro'd list
+//Give them unique names!
+#define EVENT_NAMES(EVENT) \
+    EVENT(ES_NO_EVENT) \
+    EVENT(ES_ERROR)  /* used to indicate an error from the service */ \
+    EVENT(ES_INIT)  /* used to transition from initial pseudo-state */ \
+    EVENT(ES_ENTRY) /* used to enter a state*/ \
+    EVENT(ES_EXIT) /* used to exit a state*/ \
+    EVENT(ES_KEYINPUT)  /* used to signify a key has been pressed*/ \
+    EVENT(ES_LISTEVENTS)  /* used to list events in keyboard input, does not get posted to fsm*/ \
+    EVENT(ES_LISTQUEUES)  /* used to list queue counters in keyboard input, does not get posted to fsm*/ \
+    EVENT(ES_TIMEOUT)  /* signals that the timer has expired, param is the timer number, bit 15 is reserved */ \
+    EVENT(ES_TIMERACTIVE)  /* signals that a timer has become active */ \
+    EVENT(ES_TIMERSTOPPED)  /* signals that a timer has stopped*/ \
+    EVENT(ES_OVERRUN)  /* a run function went over its budget, param is the service */ \
+    /* User-defined events start here */ \
+    EVENT(WAS_DARK_NOW_LIGHT)  /* light on event*/ \
+    EVENT(WAS_LIGHT_NOW_DARK)  /* light on event*/ \
+    EVENT(BUMPED)  /* Bump sensors triggered*/ \
+    EVENT(DONE_EVADING)  /*lower level evade state machine done */ \
+    
+// This turns the EVENT_NAMES list into an enum statement
+// To see how it expands, right-click -> navigate -> View macro expansion
+#define ENUM_FORM(STATE) STATE, //Enums are reprinted verbatim and comma'd
+typedef enum {
+    EVENT_NAMES(ENUM_FORM)
+    NUMBEROFEVENTS,
+} ES_EventTyp_t;
+
+// This turns the EVENT_NAMES into a list of strings
+// To see how it expands, right-click -> navigate -> View macro expansion
+#define STRING_FORM(STATE) #STATE, //Strings are stringified and comma'd
+static const char *EventNames[] = {
+    EVENT_NAMES(STRING_FORM)
+};
+
+/****************************************************************************/
+// Level type events that should not pile up in a queue. If one of these is
+// posted while another of the same type is still waiting in the service's
+// queue, the waiting one takes the new EventParam instead of a second one
+// being added. Leave the list empty to turn this off, at most 32 events.
+#define COALESCED_EVENTS(EVENT) \
+    EVENT(WAS_DARK_NOW_LIGHT) \
+    EVENT(WAS_LIGHT_NOW_DARK) \
+
+/****************************************************************************/
+// Pools of blocks for events that carry more than fits in EventParam. Each
+// POOL(Size, Count) is Count blocks of Size bytes, list them smallest first
+// with different sizes, at most 8 pools of up to 32 blocks. The events in
+// PAYLOAD_EVENTS carry a handle from ES_PayloadAlloc in their EventParam, and
+// the block is freed once every service it was posted to has run with it.
+// Leave the pools empty to turn this off, for example:
+//    POOL(16, 8)
+//    POOL(64, 2)
+#define PAYLOAD_POOLS(POOL) \
+
+#define PAYLOAD_EVENTS(EVENT) \
+
+/****************************************************************************/
+// This are the name of the Event checking funcion header file.
+#define EVENT_CHECK_HEADER "HostStubs.h"
+
+/****************************************************************************/
+// This is the list of event checking functions, one line per checker, in the
+// form
+//     CHECKER(Function, PeriodMs, Ready)
+// While all the queues are empty ES_Run calls them in turn, starting after
+// the last one that found an event. A checker is skipped until PeriodMs has
+// passed since its last call (0 to call it every time) and while Ready, an
+// expression, is false. Use Ready for checkers that can only find something
+// once new data is in, for example
+//     CHECKER(CheckLightLevel, 0, AD_IsNewDataReady())
+// and TRUE for the others.
+#define EVENT_CHECK_LIST(CHECKER) \
+
+/****************************************************************************/
+// These are the definitions for the post functions to be executed when the
+// correspnding timer expires. All 8 must be defined. If you are not using
+// a timers, then you can use TIMER_UNUSED
+#define TIMER_UNUSED ((pPostFunc)0)
+#define TIMER0_RESP_FUNC PostTimerService
+#define TIMER1_RESP_FUNC PostTimerService
+//user modifiable timers start below here
+#define TIMER2_RESP_FUNC TIMER_UNUSED
+#define TIMER3_RESP_FUNC TIMER_UNUSED
+#define TIMER4_RESP_FUNC TIMER_UNUSED
+#define TIMER5_RESP_FUNC TIMER_UNUSED
+#define TIMER6_RESP_FUNC TIMER_UNUSED
+#define TIMER7_RESP_FUNC TIMER_UNUSED
+#define TIMER8_RESP_FUNC TIMER_UNUSED
+#define TIMER9_RESP_FUNC TIMER_UNUSED
+#define TIMER10_RESP_FUNC TIMER_UNUSED
+#define TIMER11_RESP_FUNC TIMER_UNUSED
+#define TIMER12_RESP_FUNC TIMER_UNUSED
+#define TIMER13_RESP_FUNC TIMER_UNUSED
+#define TIMER14_RESP_FUNC TIMER_UNUSED
+#define TIMER15_RESP_FUNC TIMER_UNUSED
+
+// the number of timers, up to 255. Those past the 16 above, and any above
+// that are TIMER_UNUSED, are handed out at run time by ES_Timer_Alloc
+#define NUM_TIMERS 64
+
+
+/****************************************************************************/
+// Give the timer numbers symbolc names to make it easier to move them
+// to different timers if the need arises. Keep these definitons close to the
+// definitions for the response functions to make it easire to check that
+// the timer number matches where the timer event will be routed
+
+
+
+/****************************************************************************/
+// The maximum number of services sets an upper bound on the number of
+// services that the framework will handle. Any value up to 32 is supported,
+// as the framework tracks the non-empty queues in a single 32 bit word.
+#define MAX_NUM_SERVICES 32
+
+/****************************************************************************/
+// This is the list of the services that are *actually* used in a particular
+// application, one line per service, in the form
+//     SERVICE(InitFunction, RunFunction, PostFunction, QueueSize, Batch, Budget)
+// The first entry is Service 0, the lowest priority service; every Events and
+// Services application must have a Service 0. Further services are added in
+// sequence (1,2,3,...) with increasing priorities. The framework builds its
+// service and queue tables and declares the three functions from this list,
+// and NUM_SERVICES is the number of entries in it. QueueSize is rounded up to
+// a power of two, at most 128. Batch is how many events in a row the service
+// may take from its queue before ES_Run looks for other ready services, a
+// higher priority service that becomes ready still ends the batch early.
+// Budget is the longest, in microseconds, that one call to the run function
+// should take, 0 for no limit. See USE_RUN_BUDGETS.
+// The benchmarks bring their own services, see BenchServices.h.
+#if defined(ES_RUN_BENCHMARK) || defined(ES_RUN_BATCH_BENCHMARK) || \
+        defined(ES_PREEMPT_BENCHMARK)
+#include "BenchServices.h"
+#else
+#define SERVICE_LIST(SERVICE) \
+    SERVICE(InitTimerService, RunTimerService, PostTimerService, 9, 4, 200) /* lowest priority, always present */ \
+
+#endif
+
+/****************************************************************************/
+// the name of the posting function that you want executed when a new 
+// keystroke is detected.
+// The default initialization distributes keystrokes to all state machines
+#define POST_KEY_FUNC ES_PostAll
+
+
+
+/****************************************************************************/
+// The services that receive each event posted with ES_Publish, one line per
+// event and service, in the form
+//     SUBSCRIBE(EventType, PostFunction)
+// where PostFunction names a service in SERVICE_LIST. An event can have any
+// number of subscribers. Services can change these at run time with
+// ES_Subscribe and ES_Unsubscribe.
+#define SUBSCRIPTIONS(SUBSCRIBE) \
+
+/****************************************************************************/
+// These are the definitions for the Distribution lists. Each definition
+// should be a comma seperated list of post functions to indicate which
+// services are on that distribution list. ES_Publish and SUBSCRIPTIONS do the
+// same job without a call through every post function on the list.
+#define NUM_DIST_LISTS 0
+#if NUM_DIST_LISTS > 0 
+#define DIST_LIST0 PostTemplateFSM
+#endif
+#if NUM_DIST_LISTS > 1 
+#define DIST_LIST1 PostTemplateFSM
+#endif
+#if NUM_DIST_LISTS > 2 
+#define DIST_LIST2 PostTemplateFSM
+#endif
+#if NUM_DIST_LISTS > 3 
+#define DIST_LIST3 PostTemplateFSM
+#endif
+#if NUM_DIST_LISTS > 4 
+#define DIST_LIST4 PostTemplateFSM
+#endif
+#if NUM_DIST_LISTS > 5 
+#define DIST_LIST5 PostTemplateFSM
+#endif
+#if NUM_DIST_LISTS > 6 
+#define DIST_LIST6 PostTemplateFSM
+#endif
+#if NUM_DIST_LISTS > 7 
+#define DIST_LIST7 PostTemplateFSM
+#endif
+
+
+
+#endif /* CONFIGURE_H */
\ No newline at end of file
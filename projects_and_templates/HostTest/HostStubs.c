@@ -0,0 +1,141 @@
+/*
+ * File: HostStubs.c
+ *
+ * What the host builds of the framework's test harnesses need from the board
+ * support and the PIC32 itself: the core timer, which counts at SYSCLK/2 from
+ * the monotonic clock, the interrupt registers the framework writes, and a
+ * serial port that is stdout. With USE_TICKLESS_TIMERS the core timer compare
+ * interrupt is SIGALRM, from a one shot interval timer set for the time the
+ * compare matches, so it is held off by EnterCritical like the real one.
+ * With USE_PREEMPTION core software interrupt 0 is SIGUSR1, raised when the
+ * framework sets its flag and left pending while interrupts are off or a
+ * timer handler is running, see host/host_builtins.h.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "ES_Configure.h"
+#include "BOARD.h"
+#include "serial.h"
+#include "peripheral/int.h"
+
+#define CORE_TICKS_PER_US 40
+
+volatile unsigned int T1CONCLR, T1CONSET, IEC0CLR, IEC0SET;
+
+unsigned int HostCoreCount(void)
+{
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    // 40MHz, the same rate as ES_ReadRunClock
+    return (unsigned int) (Now.tv_sec * 40000000ULL + Now.tv_nsec / 25);
+}
+
+#ifdef USE_TICKLESS_TIMERS
+void CoreTimerIntHandler(void);
+
+static void CoreTimerSignal(int Signal)
+{
+    CoreTimerIntHandler();
+}
+
+static void CoreTimerAlarm(unsigned long WaitUs)
+{
+    struct itimerval Match = {{0, 0}, {WaitUs / 1000000UL, WaitUs % 1000000UL}};
+    struct sigaction Action = {{0}};
+
+    Action.sa_handler = CoreTimerSignal;
+    HostInterruptSignals(&Action.sa_mask);
+    sigaction(HOST_TIMER_SIGNAL, &Action, NULL);
+    setitimer(ITIMER_REAL, &Match, NULL);
+}
+#endif
+
+void HostSetCompare(unsigned int Compare)
+{
+#ifdef USE_TICKLESS_TIMERS
+    // like the real one it matches on the way past, a compare the count is
+    // already beyond waits for the count to wrap round to it
+    CoreTimerAlarm((Compare - HostCoreCount()) / CORE_TICKS_PER_US + 1);
+#endif
+}
+
+void HostCoreTimerFlag(int Set)
+{
+#ifdef USE_TICKLESS_TIMERS
+    if (Set) {
+        CoreTimerAlarm(1);
+    }
+#endif
+}
+
+#ifdef USE_PREEMPTION
+void CoreSoftware0Handler(void);
+
+static void SoftwareSignal(int Signal)
+{
+    CoreSoftware0Handler();
+}
+#endif
+
+void HostIntEnable(int Source, int Enable)
+{
+#ifdef USE_PREEMPTION
+    struct sigaction Action = {{0}};
+
+    if ((Source == INT_CS0) && Enable) {
+        // blocked while it runs, until the handler drops its priority level
+        Action.sa_handler = SoftwareSignal;
+        sigemptyset(&Action.sa_mask);
+        sigaction(HOST_SOFTWARE_SIGNAL, &Action, NULL);
+    }
+#endif
+}
+
+void HostRequestSoftInt(void)
+{
+#ifdef USE_PREEMPTION
+    raise(HOST_SOFTWARE_SIGNAL);
+#endif
+}
+
+void BOARD_Init()
+{
+    setvbuf(stdout, NULL, _IONBF, 0);
+}
+
+void BOARD_End()
+{
+}
+
+unsigned int BOARD_GetPBClock()
+{
+    return 40000000;
+}
+
+void SERIAL_Init(void)
+{
+}
+
+void PutChar(char ch)
+{
+    putchar(ch);
+}
+
+char GetChar(void)
+{
+    return 0;
+}
+
+char IsTransmitEmpty(void)
+{
+    return TRUE;
+}
+
+char IsReceiveEmpty(void)
+{
+    return TRUE;
+}
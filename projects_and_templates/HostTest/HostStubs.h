@@ -0,0 +1,11 @@
+/*
+ * File: HostStubs.h
+ *
+ * The event checker header named in this directory's ES_Configure.h. The host
+ * builds have no event checkers, see EVENT_CHECK_LIST.
+ */
+
+#ifndef HOST_STUBS_H
+#define HOST_STUBS_H
+
+#endif /* HOST_STUBS_H */
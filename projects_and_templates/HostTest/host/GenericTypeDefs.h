@@ -0,0 +1,16 @@
+/*
+ * File: GenericTypeDefs.h
+ *
+ * Host stand-in for the Microchip header of the same name, only what BOARD.h
+ * and the framework use.
+ */
+
+#ifndef HOST_GENERIC_TYPE_DEFS_H
+#define HOST_GENERIC_TYPE_DEFS_H
+
+#define TRUE 1
+#define FALSE 0
+
+typedef unsigned int UINT32;
+
+#endif /* HOST_GENERIC_TYPE_DEFS_H */
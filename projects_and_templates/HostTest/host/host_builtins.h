@@ -0,0 +1,53 @@
+/*
+ * File: host_builtins.h
+ *
+ * Host stand-ins for the XC32 builtins that turn interrupts off and on. The
+ * harnesses' interrupts are signals, SIGALRM for the timers and SIGUSR1 for
+ * core software interrupt 0, so EnterCritical blocks both and ExitCritical
+ * unblocks them again unless they were already blocked, which keeps critical
+ * sections nestable as they are on the PIC32. A timer handler is installed
+ * with SIGUSR1 in its mask, as the software interrupt is the lower priority.
+ * Included ahead of every file by the Makefile.
+ */
+
+#ifndef HOST_BUILTINS_H
+#define HOST_BUILTINS_H
+
+#include <signal.h>
+#include <stddef.h>
+
+#define HOST_TIMER_SIGNAL SIGALRM
+#define HOST_SOFTWARE_SIGNAL SIGUSR1
+
+static inline void HostInterruptSignals(sigset_t *pSignals)
+{
+    sigemptyset(pSignals);
+    sigaddset(pSignals, HOST_TIMER_SIGNAL);
+    sigaddset(pSignals, HOST_SOFTWARE_SIGNAL);
+}
+
+static inline unsigned int __builtin_disable_interrupts(void)
+{
+    sigset_t Interrupts, Old;
+    HostInterruptSignals(&Interrupts);
+    sigprocmask(SIG_BLOCK, &Interrupts, &Old);
+    return sigismember(&Old, HOST_TIMER_SIGNAL);
+}
+
+static inline void __builtin_enable_interrupts(void)
+{
+    sigset_t Interrupts;
+    HostInterruptSignals(&Interrupts);
+    sigprocmask(SIG_UNBLOCK, &Interrupts, NULL);
+}
+
+// only ever used to put back the Status register EnterCritical saved, or to
+// drop the priority level to 0 so that a handler can be nested
+#define __builtin_mtc0(Reg, Sel, Value) do { \
+        if (!(Value)) { \
+            __builtin_enable_interrupts(); \
+        } \
+    } while (0)
+#define __builtin_mfc0(Reg, Sel) 0u
+
+#endif /* HOST_BUILTINS_H */
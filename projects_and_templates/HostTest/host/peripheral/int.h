@@ -0,0 +1,25 @@
+/*
+ * File: int.h
+ *
+ * Host stand-in for the PIC32 peripheral library's interrupt controller
+ * calls, for USE_PREEMPTION. Enabling core software interrupt 0 installs
+ * its signal handler, see HostStubs.c, priorities are left to the signal
+ * masks.
+ */
+
+#ifndef HOST_PERIPHERAL_INT_H
+#define HOST_PERIPHERAL_INT_H
+
+#define INT_CORE_SOFTWARE_0_VECTOR 1
+#define INT_CS0 1
+#define INT_PRIORITY_LEVEL_1 1
+#define INT_ENABLED 1
+#define INT_DISABLED 0
+
+void HostIntEnable(int Source, int Enable);
+
+#define INTSetVectorPriority(Vector, Priority) ((void) (Vector), (void) (Priority))
+#define INTClearFlag(Source) ((void) (Source))
+#define INTEnable(Source, Enable) HostIntEnable(Source, Enable)
+
+#endif /* HOST_PERIPHERAL_INT_H */
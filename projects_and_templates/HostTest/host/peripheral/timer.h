@@ -0,0 +1,35 @@
+/*
+ * File: timer.h
+ *
+ * Host stand-in for the PIC32 peripheral library's timer calls. Setting a
+ * timer up does nothing, the harnesses call the interrupt handlers
+ * themselves, or the core timer compare raises SIGALRM, and setting the core
+ * timer flag raises it straight away, see HostStubs.c.
+ */
+
+#ifndef HOST_PERIPHERAL_TIMER_H
+#define HOST_PERIPHERAL_TIMER_H
+
+#define T1_ON 0x8000
+#define T1_SOURCE_INT 0
+#define T1_PS_1_1 0
+#define T1_INT_ON 0x8
+#define T1_INT_PRIOR_3 3
+#define CT_INT_ON 0x8
+#define CT_INT_OFF 0
+#define CT_INT_PRIOR_2 2
+#define CT_INT_PRIOR_3 3
+
+void HostCoreTimerFlag(int Set);
+
+#define OpenTimer1(Config, Period) ((void) (Config), (void) (Period))
+#define ConfigIntTimer1(Config) ((void) (Config))
+#define mT1IntEnable(Enable) ((void) (Enable))
+#define mT1ClearIntFlag() ((void) 0)
+#define OpenCoreTimer(Period) ((void) (Period))
+#define UpdateCoreTimer(Period) ((void) (Period))
+#define mConfigIntCoreTimer(Config) ((void) (Config))
+#define mCTClearIntFlag() HostCoreTimerFlag(0)
+#define mCTSetIntFlag() HostCoreTimerFlag(1)
+
+#endif /* HOST_PERIPHERAL_TIMER_H */
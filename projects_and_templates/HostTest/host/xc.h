@@ -0,0 +1,36 @@
+/*
+ * File: xc.h
+ *
+ * Host stand-in for the XC32 device header, just enough of it for
+ * ES_Framework.c to build and run on a PC. The core timer counts at the
+ * PIC32's SYSCLK/2 from the monotonic clock, see HostStubs.c, and the
+ * interrupts are signals that the test harnesses raise themselves.
+ */
+
+#ifndef HOST_XC_H
+#define HOST_XC_H
+
+#include <stdint.h>
+
+#define __ISR(Vector, Ipl)
+#define _CORE_TIMER_VECTOR 0
+#define _CORE_SOFTWARE_0_VECTOR 1
+#define _TIMER_1_VECTOR 4
+
+extern volatile unsigned int T1CONCLR, T1CONSET, IEC0CLR, IEC0SET;
+#define _T1CON_ON_MASK 0x8000
+#define _IEC0_CTIE_MASK 0x1
+#define _CP0_CAUSE_IP0_MASK 0x100
+#define _CP0_STATUS_IPL_MASK 0x1c00
+
+unsigned int HostCoreCount(void);
+void HostSetCompare(unsigned int Compare);
+void HostRequestSoftInt(void);
+
+#define _CP0_GET_COUNT() HostCoreCount()
+#define _CP0_SET_COMPARE(Compare) HostSetCompare(Compare)
+#define _CP0_BIS_CAUSE(Mask) HostRequestSoftInt()
+#define _CP0_BIC_CAUSE(Mask) ((void) (Mask))
+#define _wait()
+
+#endif /* HOST_XC_H */
@@ -22,7 +22,6 @@
  ******************************************************************************/
 #define FullStop() Roach_LeftMtrSpeed(0);Roach_RightMtrSpeed(0)
 #define StraightForward(x) Roach_LeftMtrSpeed(x);Roach_RightMtrSpeed(x)
-#define MAIN_TIMER 0
 
 /*******************************************************************************
  * PRIVATE FUNCTION PROTOTYPES                                                 *
@@ -38,6 +37,7 @@
 
 static RoachState_t CurrentState = Init;
 static uint8_t MyPriority;
+static uint8_t MainTimer; // handed out by ES_Timer_Alloc
 
 
 #define STRING_FORM(STATE) #STATE, //Strings are stringified and comma'd
@@ -60,6 +60,10 @@ static const char *StateNames[] = {
  * @author Gabriel H Elkaim, 2013.09.26 15:33 */
 uint8_t InitRoachFSM(uint8_t Priority) {
     MyPriority = Priority;
+    MainTimer = ES_Timer_Alloc(PostRoachFSM);
+    if (MainTimer == ES_TIMER_NO_HANDLE) {
+        return FALSE;
+    }
     // put us into the Initial PseudoState
     CurrentState = Init;
     // post the initial transition event
@@ -117,7 +121,7 @@ ES_Event RunRoachFSM(ES_Event ThisEvent) {
                 // this is where you would put any actions associated with the
                 // transition from the initial pseudo-state into the actual
                 // initial state
-                ES_Timer_InitTimer(MAIN_TIMER, 5000);
+                ES_Timer_InitPeriodicTimer(MainTimer, 5000); // ping pong every 5s
                 
                 // now put the machine into the state you want to be first
                 nextState = Moving;  //Pick the next state
@@ -144,7 +148,6 @@ ES_Event RunRoachFSM(ES_Event ThisEvent) {
                     }
                     break;
                 case ES_TIMEOUT:
-                    ES_Timer_InitTimer(ES_TIMEOUT, 5000);
                     nextState = Stopped;
                     makeTransition = TRUE;
                     ThisEvent.EventType = ES_NO_EVENT;
@@ -177,7 +180,6 @@ ES_Event RunRoachFSM(ES_Event ThisEvent) {
                     break;
 
                 case ES_TIMEOUT:
-                    ES_Timer_InitTimer(ES_TIMEOUT, 5000);
                     nextState = Moving;
                     makeTransition = TRUE;
                     ThisEvent.EventType = ES_NO_EVENT;
@@ -28,6 +28,38 @@
 //uncomment to supress the entry and exit events
 //#define SUPPRESS_EXIT_ENTRY_IN_TATTLE
 
+//uncomment for a 32 bit EventParam, doubling the size of every ES_Event
+//#define ES_WIDE_EVENT_PARAM
+
+//uncomment to time every run function against its Budget in SERVICE_LIST
+//#define USE_RUN_BUDGETS
+//uncomment to have an ES_OVERRUN event posted when a run function goes over
+//#define RUN_OVERRUN_POST_FUNC PostKeyboardInput
+
+//uncomment to idle the CPU while there are no events and no checker is due
+//#define USE_IDLE_WAIT
+
+//uncomment to run the ES timers from the core timer compare, which interrupts
+//only when a timer is due rather than every millisecond, leaving Timer1 free
+//#define USE_TICKLESS_TIMERS
+
+//uncomment to count each timer's timeouts and how late they reach a run function
+//#define USE_TIMER_STATS
+
+//uncomment to have interrupts post through a ring that ES_Run empties into the
+//service queues, rather than call post functions from the interrupt
+//#define USE_ISR_POST_RING
+//entries in the ring, a power of two no bigger than 128
+#define ISR_POST_RING_SIZE 32
+
+//uncomment to stop the timers posting ES_TIMERACTIVE and ES_TIMERSTOPPED as they
+//are started and stopped, ES_Timer_GetTimerState reads the state instead
+//#define SUPPRESS_TIMER_STATE_EVENTS
+
+//uncomment to let a post to a higher priority service preempt the run
+//function that is executing, rather than wait for it to return
+//#define USE_PREEMPTION
+
 /****************************************************************************/
 // Name/define the events of interest
 // Universal events occupy the lowest entries, followed by user-defined events
@@ -42,9 +74,11 @@
     EVENT(ES_EXIT) /* used to exit a state*/ \
     EVENT(ES_KEYINPUT)  /* used to signify a key has been pressed*/ \
     EVENT(ES_LISTEVENTS)  /* used to list events in keyboard input, does not get posted to fsm*/ \
-    EVENT(ES_TIMEOUT)  /* signals that the timer has expired */ \
+    EVENT(ES_LISTQUEUES)  /* used to list queue counters in keyboard input, does not get posted to fsm*/ \
+    EVENT(ES_TIMEOUT)  /* signals that the timer has expired, param is the timer number, bit 15 is reserved */ \
     EVENT(ES_TIMERACTIVE)  /* signals that a timer has become active */ \
     EVENT(ES_TIMERSTOPPED)  /* signals that a timer has stopped*/ \
+    EVENT(ES_OVERRUN)  /* a run function went over its budget, param is the service */ \
     /* User-defined events start here */ \
     EVENT (LIGHTLEVEL) \
     EVENT(BUMPED)  /* Bump sensors triggered*/ \
@@ -65,13 +99,44 @@ static const char *EventNames[] = {
     EVENT_NAMES(STRING_FORM)
 };
 
+/****************************************************************************/
+// Level type events that should not pile up in a queue. If one of these is
+// posted while another of the same type is still waiting in the service's
+// queue, the waiting one takes the new EventParam instead of a second one
+// being added. Leave the list empty to turn this off, at most 32 events.
+#define COALESCED_EVENTS(EVENT) \
+    EVENT(LIGHTLEVEL) \
+
+/****************************************************************************/
+// Pools of blocks for events that carry more than fits in EventParam. Each
+// POOL(Size, Count) is Count blocks of Size bytes, list them smallest first
+// with different sizes, at most 8 pools of up to 32 blocks. The events in
+// PAYLOAD_EVENTS carry a handle from ES_PayloadAlloc in their EventParam, and
+// the block is freed once every service it was posted to has run with it.
+// Leave the pools empty to turn this off, for example:
+//    POOL(16, 8)
+//    POOL(64, 2)
+#define PAYLOAD_POOLS(POOL) \
+
+#define PAYLOAD_EVENTS(EVENT) \
+
 /****************************************************************************/
 // This are the name of the Event checking funcion header file.
 #define EVENT_CHECK_HEADER "RoachFrameworkEvents.h"
 
 /****************************************************************************/
-// This is the list of event checking functions
-#define EVENT_CHECK_LIST  CheckBumps
+// This is the list of event checking functions, one line per checker, in the
+// form
+//     CHECKER(Function, PeriodMs, Ready)
+// While all the queues are empty ES_Run calls them in turn, starting after
+// the last one that found an event. A checker is skipped until PeriodMs has
+// passed since its last call (0 to call it every time) and while Ready, an
+// expression, is false. Use Ready for checkers that can only find something
+// once new data is in, for example
+//     CHECKER(CheckLightLevel, 0, AD_IsNewDataReady())
+// and TRUE for the others.
+#define EVENT_CHECK_LIST(CHECKER) \
+    CHECKER(CheckBumps, 5, TRUE) \
 
 /****************************************************************************/
 // These are the definitions for the post functions to be executed when the
@@ -96,6 +161,10 @@ static const char *EventNames[] = {
 #define TIMER14_RESP_FUNC TIMER_UNUSED
 #define TIMER15_RESP_FUNC TIMER_UNUSED
 
+// the number of timers, up to 255. Those past the 16 above, and any above
+// that are TIMER_UNUSED, are handed out at run time by ES_Timer_Alloc
+#define NUM_TIMERS 64
+
 
 /****************************************************************************/
 // Give the timer numbers symbolc names to make it easier to move them
@@ -107,125 +176,29 @@ static const char *EventNames[] = {
 
 
 /****************************************************************************/
-// The maximum number of services sets an upper bound on the number of 
-// services that the framework will handle. Reasonable values are 8 and 16
-// HOWEVER: at this time only a value of 8 is supported.
-#define MAX_NUM_SERVICES 8
+// The maximum number of services sets an upper bound on the number of
+// services that the framework will handle. Any value up to 32 is supported,
+// as the framework tracks the non-empty queues in a single 32 bit word.
+#define MAX_NUM_SERVICES 32
 
 /****************************************************************************/
-// This macro determines that nuber of services that are *actually* used in
-// a particular application. It will vary in value from 1 to MAX_NUM_SERVICES
-#define NUM_SERVICES 3
-
-/****************************************************************************/
-// These are the definitions for Service 0, the lowest priority service
-// every Events and Services application must have a Service 0. Further 
-// services are added in numeric sequence (1,2,3,...) with increasing 
-// priorities
-// the header file with the public fuction prototypes
-#ifdef DEV
-#define SERV_0_HEADER "ES_TimerService.h"
-#endif
-// the name of the Init function
-#define SERV_0_INIT InitTimerService
-// the name of the run function
-#define SERV_0_RUN RunTimerService
-// How big should this service's Queue be?
-#define SERV_0_QUEUE_SIZE 9
-
-/****************************************************************************/
-// These are the definitions for Service 1
-#if NUM_SERVICES > 1
-// the header file with the public fuction prototypes
-#ifdef DEV
-#define SERV_1_HEADER "ES_KeyboardInput.h"
-#endif
-// the name of the Init function
-#define SERV_1_INIT InitKeyboardInput
-// the name of the run function
-#define SERV_1_RUN RunKeyboardInput
-// How big should this services Queue be?
-#define SERV_1_QUEUE_SIZE 9
-#endif
-
-// These are the definitions for Service 2
-#if NUM_SERVICES > 2
-// the header file with the public fuction prototypes
-#define SERV_2_HEADER "TemplateHSM.h"
-// the name of the Init function
-#define SERV_2_INIT InitTemplateHSM
-// the name of the run function
-#define SERV_2_RUN RunTemplateHSM
-// How big should this services Queue be?
-#define SERV_2_QUEUE_SIZE 3
-#endif
-
-
-
-/****************************************************************************/
-// These are the definitions for Service 3
-#if NUM_SERVICES > 3
-// the header file with the public fuction prototypes
-#define SERV_3_HEADER "TestService.h"
-// the name of the Init function
-#define SERV_3_INIT TestServiceInit
-// the name of the run function
-#define SERV_3_RUN TestServiceRun
-// How big should this services Queue be?
-#define SERV_3_QUEUE_SIZE 3
-#endif
-
-/****************************************************************************/
-// These are the definitions for Service 4
-#if NUM_SERVICES > 4
-// the header file with the public fuction prototypes
-#define SERV_4_HEADER "TestService.h"
-// the name of the Init function
-#define SERV_4_INIT TestServiceInit
-// the name of the run function
-#define SERV_4_RUN TestServiceRun
-// How big should this services Queue be?
-#define SERV_4_QUEUE_SIZE 3
-#endif
-
-/****************************************************************************/
-// These are the definitions for Service 5
-#if NUM_SERVICES > 5
-// the header file with the public fuction prototypes
-#define SERV_5_HEADER "TestService.h"
-// the name of the Init function
-#define SERV_5_INIT TestServiceInit
-// the name of the run function
-#define SERV_5_RUN TestServiceRun
-// How big should this services Queue be?
-#define SERV_5_QUEUE_SIZE 3
-#endif
-
-/****************************************************************************/
-// These are the definitions for Service 6
-#if NUM_SERVICES > 6
-// the header file with the public fuction prototypes
-#define SERV_6_HEADER "TestService.h"
-// the name of the Init function
-#define SERV_6_INIT TestServiceInit
-// the name of the run function
-#define SERV_6_RUN TestServiceRun
-// How big should this services Queue be?
-#define SERV_6_QUEUE_SIZE 3
-#endif
-
-/****************************************************************************/
-// These are the definitions for Service 7
-#if NUM_SERVICES > 7
-// the header file with the public fuction prototypes
-#define SERV_7_HEADER "TestService.h"
-// the name of the Init function
-#define SERV_7_INIT TestServiceInit
-// the name of the run function
-#define SERV_7_RUN TestServiceRun
-// How big should this services Queue be?
-#define SERV_7_QUEUE_SIZE 3
-#endif
+// This is the list of the services that are *actually* used in a particular
+// application, one line per service, in the form
+//     SERVICE(InitFunction, RunFunction, PostFunction, QueueSize, Batch, Budget)
+// The first entry is Service 0, the lowest priority service; every Events and
+// Services application must have a Service 0. Further services are added in
+// sequence (1,2,3,...) with increasing priorities. The framework builds its
+// service and queue tables and declares the three functions from this list,
+// and NUM_SERVICES is the number of entries in it. QueueSize is rounded up to
+// a power of two, at most 128. Batch is how many events in a row the service
+// may take from its queue before ES_Run looks for other ready services, a
+// higher priority service that becomes ready still ends the batch early.
+// Budget is the longest, in microseconds, that one call to the run function
+// should take, 0 for no limit. See USE_RUN_BUDGETS.
+#define SERVICE_LIST(SERVICE) \
+    SERVICE(InitTimerService, RunTimerService, PostTimerService, 9, 4, 200) /* lowest priority, always present */ \
+    SERVICE(InitKeyboardInput, RunKeyboardInput, PostKeyboardInput, 9, 8, 0) \
+    SERVICE(InitTemplateHSM, RunTemplateHSM, PostTemplateHSM, 3, 1, 500) \
 
 /****************************************************************************/
 // the name of the posting function that you want executed when a new 
@@ -235,10 +208,23 @@ static const char *EventNames[] = {
 
 
 
+/****************************************************************************/
+// The services that receive each event posted with ES_Publish, one line per
+// event and service, in the form
+//     SUBSCRIBE(EventType, PostFunction)
+// where PostFunction names a service in SERVICE_LIST. An event can have any
+// number of subscribers. Services can change these at run time with
+// ES_Subscribe and ES_Unsubscribe.
+#define SUBSCRIPTIONS(SUBSCRIBE) \
+    SUBSCRIBE(LIGHTLEVEL, PostTemplateHSM) \
+    SUBSCRIBE(BUMPED, PostTemplateHSM) \
+    SUBSCRIBE(DONE_EVADING, PostTemplateHSM) \
+
 /****************************************************************************/
 // These are the definitions for the Distribution lists. Each definition
 // should be a comma seperated list of post functions to indicate which
-// services are on that distribution list.
+// services are on that distribution list. ES_Publish and SUBSCRIPTIONS do the
+// same job without a call through every post function on the list.
 #define NUM_DIST_LISTS 0
 #if NUM_DIST_LISTS > 0 
 #define DIST_LIST0 PostTemplateFSM
@@ -62,6 +62,9 @@ static const char *StateNames[] = {
 static TemplateState_t CurrentState = InitHState; // <- change enum name to match ENUM
 static uint8_t MyPriority;
 
+// events a state can not handle yet are parked here, see YetAnotherState
+static ES_Event DeferralQueue[ES_QUEUE_BLOCK_SIZE(3)];
+
 
 /*******************************************************************************
  * PUBLIC FUNCTIONS                                                            *
@@ -79,6 +82,7 @@ static uint8_t MyPriority;
  * @author J. Edward Carryer, 2011.10.23 19:25 */
 uint8_t InitTemplateHSM(uint8_t Priority) {
     MyPriority = Priority;
+    ES_InitQueue(DeferralQueue, ARRAY_SIZE(DeferralQueue));
     // put us into the Initial PseudoState
     CurrentState = InitHState;
     // post the initial transition event
@@ -238,6 +242,15 @@ ES_Event RunTemplateHSM(ES_Event ThisEvent) {
                 case ES_EXIT:
                     // this is where you would put any actions associated with the
                     // exit from this state
+                    // hand back anything deferred, it goes ahead of what is queued
+                    ES_RecallEvents(MyPriority, DeferralQueue);
+                    break;
+
+                case BUMPED:
+                    // this is an example of an event that can not be handled
+                    // until the state is done, park it for the next state
+                    ES_DeferEvent(DeferralQueue, ThisEvent);
+                    ThisEvent.EventType = ES_NO_EVENT;
                     break;
 
                 case ES_KEYINPUT:
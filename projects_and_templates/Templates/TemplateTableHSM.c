@@ -0,0 +1,277 @@
+/*
+ * File: TemplateTableHSM.c
+ * Author: J. Edward Carryer
+ * Modified: Gabriel H Elkaim
+ *
+ * Template file to set up a table driven Heirarchical State Machine to work with
+ * the Events and Services Framework (ES_Framework). Note that this file will need
+ * to be modified to fit your exact needs, and most of the names will have to be
+ * changed to match your code.
+ *
+ * Each state has its own handler. A handler returns ES_NO_EVENT for the events it
+ * consumes and the event itself for the ones its parent should see, and calls
+ * ES_HSM_Transition to change state. ES_ENTRY and ES_EXIT are sent to each state
+ * that is entered or left, from the outside in and the inside out.
+ *
+ * This is provided as an example and a good place to start.
+ */
+
+
+/*******************************************************************************
+ * MODULE #INCLUDE                                                             *
+ ******************************************************************************/
+
+#include "ES_Configure.h"
+#include "ES_Framework.h"
+#include "BOARD.h"
+#include "TemplateTableHSM.h"
+
+/*******************************************************************************
+ * PRIVATE #DEFINES                                                            *
+ ******************************************************************************/
+//Include any defines you need to do
+/*******************************************************************************
+ * MODULE #DEFINES                                                             *
+ ******************************************************************************/
+
+
+#define TABLE_STRING_FORM(STATE, PARENT, CHILD) #STATE, //Strings are stringified and comma'd
+static const char *StateNames[] = {
+    LIST_OF_TABLE_HSM_STATES(TABLE_STRING_FORM)
+};
+
+/*******************************************************************************
+ * PRIVATE FUNCTION PROTOTYPES                                                 *
+ ******************************************************************************/
+/* One handler per state, named after the state with Handler on the end */
+#define TABLE_HANDLER_FORM(STATE, PARENT, CHILD) \
+    static ES_Event STATE##Handler(ES_HSM_t *pMachine, ES_Event ThisEvent);
+LIST_OF_TABLE_HSM_STATES(TABLE_HANDLER_FORM)
+
+/*******************************************************************************
+ * PRIVATE MODULE VARIABLES                                                            *
+ ******************************************************************************/
+/* You will need MyPriority and the machine; you may need others as well. */
+
+#define TABLE_ENTRY_FORM(STATE, PARENT, CHILD) {STATE##Handler, PARENT, CHILD},
+static const ES_HSMState_t StateTable[] = {
+    LIST_OF_TABLE_HSM_STATES(TABLE_ENTRY_FORM)
+};
+
+static ES_HSM_t Machine;
+static uint8_t MyPriority;
+
+
+/*******************************************************************************
+ * PUBLIC FUNCTIONS                                                            *
+ ******************************************************************************/
+
+/**
+ * @Function InitTemplateTableHSM(uint8_t Priority)
+ * @param Priority - internal variable to track which event queue to use
+ * @return TRUE or FALSE
+ * @brief This will get called by the framework at the beginning of the code
+ *        execution. It will post an ES_INIT event to the appropriate event
+ *        queue, which will be handled inside RunTemplateTableHSM function.
+ *        Remember to rename this to something appropriate.
+ *        Returns TRUE if successful, FALSE otherwise */
+uint8_t InitTemplateTableHSM(uint8_t Priority)
+{
+    MyPriority = Priority;
+    // put us into the Initial PseudoState
+    ES_HSM_Init(&Machine, StateTable, InitPTableState);
+    // post the initial transition event
+    if (ES_PostToService(MyPriority, INIT_EVENT) == TRUE) {
+        return TRUE;
+    } else {
+        return FALSE;
+    }
+}
+
+
+/**
+ * @Function PostTemplateTableHSM(ES_Event ThisEvent)
+ * @param ThisEvent - the event (type and param) to be posted to queue
+ * @return TRUE or FALSE
+ * @brief This function is a wrapper to the queue posting function, and its name
+ *        will be used inside ES_Configure to point to which queue events should
+ *        be posted to. Remember to rename to something appropriate.
+ *        Returns TRUE if successful, FALSE otherwise */
+uint8_t PostTemplateTableHSM(ES_Event ThisEvent)
+{
+    return ES_PostToService(MyPriority, ThisEvent);
+}
+
+
+/**
+ * @Function QueryTemplateTableHSM(void)
+ * @param none
+ * @return Current leaf state of the state machine
+ * @brief This function is a wrapper to return the current state of the state
+ *        machine. Return will match the ENUM above. Remember to rename to
+ *        something appropriate. */
+TemplateTableState_t QueryTemplateTableHSM(void)
+{
+    return (TemplateTableState_t) ES_HSM_GetState(&Machine);
+}
+
+
+/**
+ * @Function RunTemplateTableHSM(ES_Event ThisEvent)
+ * @param ThisEvent - the event (type and param) to be responded.
+ * @return Event - return event (type and param), in general should be ES_NO_EVENT
+ * @brief This function hands the event to ES_HSM_Dispatch, which offers it to
+ *        the handler of the current state and then to the handlers of its
+ *        parents until one consumes it. A handler asks for a transition with
+ *        ES_HSM_Transition, and the exits and entries are then sent in order
+ *        without calling this function again.
+ * @note Remember to rename to something appropriate. */
+ES_Event RunTemplateTableHSM(ES_Event ThisEvent)
+{
+    TemplateTableState_t CurrentState = QueryTemplateTableHSM(); // for ES_Tattle
+
+    ES_Tattle(); // trace call stack
+
+    ThisEvent = ES_HSM_Dispatch(&Machine, ThisEvent);
+
+    ES_Tail(); // trace call stack end
+    return ThisEvent;
+}
+
+
+/*******************************************************************************
+ * PRIVATE FUNCTIONS                                                           *
+ ******************************************************************************/
+
+static ES_Event InitPTableStateHandler(ES_HSM_t *pMachine, ES_Event ThisEvent)
+{
+    if (ThisEvent.EventType == ES_INIT) {// only respond to ES_Init
+        // this is where you would put any actions associated with the
+        // transition from the initial pseudo-state into the actual
+        // initial state
+        ES_HSM_Transition(pMachine, BusyState);
+        ThisEvent.EventType = ES_NO_EVENT;
+    }
+    return ThisEvent;
+}
+
+static ES_Event BusyStateHandler(ES_HSM_t *pMachine, ES_Event ThisEvent)
+{
+    switch (ThisEvent.EventType) {
+    case ES_ENTRY:
+        // this is where you would put any actions associated with the
+        // entry to this state, it runs before the entry to BusyFirstState
+        break;
+
+    case ES_EXIT:
+        // this is where you would put any actions associated with the
+        // exit from this state, it runs after the exit from the child
+        break;
+
+    case ES_KEYINPUT:
+        // any event the child states do not consume comes up to here,
+        // this one leaves both child states for IdleState
+        ES_HSM_Transition(pMachine, IdleState);
+        ThisEvent.EventType = ES_NO_EVENT;
+        break;
+
+    default: // all unhandled events pass the event back up to the caller
+        break;
+    }
+    return ThisEvent;
+}
+
+static ES_Event BusyFirstStateHandler(ES_HSM_t *pMachine, ES_Event ThisEvent)
+{
+    switch (ThisEvent.EventType) {
+    case ES_TIMEOUT:
+        // a transition to a sibling exits this state only, BusyState stays
+        ES_HSM_Transition(pMachine, BusySecondState);
+        ThisEvent.EventType = ES_NO_EVENT;
+        break;
+
+    default: // all unhandled events pass the event back up to the parent
+        break;
+    }
+    return ThisEvent;
+}
+
+static ES_Event BusySecondStateHandler(ES_HSM_t *pMachine, ES_Event ThisEvent)
+{
+    switch (ThisEvent.EventType) {
+    case ES_TIMEOUT:
+        ES_HSM_Transition(pMachine, BusyFirstState);
+        ThisEvent.EventType = ES_NO_EVENT;
+        break;
+
+    default: // all unhandled events pass the event back up to the parent
+        break;
+    }
+    return ThisEvent;
+}
+
+static ES_Event IdleStateHandler(ES_HSM_t *pMachine, ES_Event ThisEvent)
+{
+    switch (ThisEvent.EventType) {
+    case ES_KEYINPUT:
+        // going back to BusyState enters it and then its initial child
+        ES_HSM_Transition(pMachine, BusyState);
+        ThisEvent.EventType = ES_NO_EVENT;
+        break;
+
+    default: // all unhandled events pass the event back up to the caller
+        break;
+    }
+    return ThisEvent;
+}
+
+/*******************************************************************************
+ * TEST HARNESS                                                                *
+ ******************************************************************************/
+/* Define TEMPLATETABLEHSM_TEST to run this file as your main file (without the
+ * rest of the framework)-useful for debugging */
+#ifdef TEMPLATETABLEHSM_TEST // <-- change this name and define it in your MPLAB-X
+                             //     project to run the test harness
+#include <stdio.h>
+
+void main(void)
+{
+    ES_Return_t ErrorType;
+    BOARD_Init();
+    // When doing testing, it is useful to annouce just which program
+    // is running.
+
+    printf("Starting the Table Driven Hierarchical State Machine Test Harness \r\n");
+    printf("using the 2nd Generation Events & Services Framework\n\r");
+
+    // Your hardware initialization function calls go here
+
+    // now initialize the Events and Services Framework and start it running
+    ErrorType = ES_Initialize();
+
+    if (ErrorType == Success) {
+        ErrorType = ES_Run();
+    }
+
+    //
+    //if we got to here, there was an error
+    //
+
+    switch (ErrorType) {
+    case FailedPointer:
+        printf("Failed on NULL pointer");
+        break;
+    case FailedInit:
+        printf("Failed Initialization");
+        break;
+    default:
+        printf("Other Failure");
+        break;
+    }
+
+    while (1) {
+        ;
+    }
+}
+
+#endif // TEMPLATETABLEHSM_TEST
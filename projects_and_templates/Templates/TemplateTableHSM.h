@@ -0,0 +1,104 @@
+/*
+ * File: TemplateTableHSM.h
+ * Author: J. Edward Carryer
+ * Modified: Gabriel H Elkaim
+ *
+ * Template file to set up a table driven Heirarchical State Machine to work with
+ * the Events and Services Framework (ES_Framework). Each state is a handler
+ * function plus its parent and initial child in a table, and ES_HSM_Dispatch in
+ * the framework does the work of passing events up the hierarchy and of sending
+ * the ES_EXIT and ES_ENTRY events on a transition, so no SubHSM files are needed.
+ * Note that this file will need to be modified to fit your exact needs, and most
+ * of the names will have to be changed to match your code.
+ *
+ * This is provided as an example and a good place to start.
+ */
+
+#ifndef TABLE_HSM_Template_H  // <- This should be changed to your own guard on both
+#define TABLE_HSM_Template_H  //    of these lines
+
+
+/*******************************************************************************
+ * PUBLIC #INCLUDES                                                            *
+ ******************************************************************************/
+
+#include "ES_Configure.h"   // defines ES_Event, INIT_EVENT, ENTRY_EVENT, and EXIT_EVENT
+#include "ES_Framework.h"   // defines ES_HSM_NO_STATE
+
+/*******************************************************************************
+ * PUBLIC #DEFINES                                                             *
+ ******************************************************************************/
+
+
+/*******************************************************************************
+ * PUBLIC TYPEDEFS                                                             *
+ ******************************************************************************/
+// typedefs for the states, which are used for the internal definition and also for
+// the return of the query function.
+// Each state is listed with its parent and the child state entered when it is
+// the target of a transition, NoState for none. The same list makes the enum,
+// the names, the handler prototypes and the state table.
+// Use unique state names!
+#define LIST_OF_TABLE_HSM_STATES(STATE)\
+        STATE(InitPTableState, NoState, NoState) /*the initial pseudo-state*/ \
+        STATE(BusyState, NoState, BusyFirstState) \
+        STATE(BusyFirstState, BusyState, NoState) \
+        STATE(BusySecondState, BusyState, NoState) \
+        STATE(IdleState, NoState, NoState) \
+
+#define TABLE_ENUM_FORM(STATE, PARENT, CHILD) STATE, //Enums are reprinted verbatim and comma'd
+typedef enum {
+    LIST_OF_TABLE_HSM_STATES(TABLE_ENUM_FORM)
+    NoState = ES_HSM_NO_STATE
+} TemplateTableState_t;
+
+/*******************************************************************************
+ * PUBLIC FUNCTION PROTOTYPES                                                  *
+ ******************************************************************************/
+
+/**
+ * @Function InitTemplateTableHSM(uint8_t Priority)
+ * @param Priority - internal variable to track which event queue to use
+ * @return TRUE or FALSE
+ * @brief This will get called by the framework at the beginning of the code
+ *        execution. It will post an ES_INIT event to the appropriate event
+ *        queue, which will be handled inside RunTemplateTableHSM function.
+ *        Remember to rename this to something appropriate.
+ *        Returns TRUE if successful, FALSE otherwise */
+uint8_t InitTemplateTableHSM(uint8_t Priority);
+
+
+/**
+ * @Function PostTemplateTableHSM(ES_Event ThisEvent)
+ * @param ThisEvent - the event (type and param) to be posted to queue
+ * @return TRUE or FALSE
+ * @brief This function is a wrapper to the queue posting function, and its name
+ *        will be used inside ES_Configure to point to which queue events should
+ *        be posted to. Remember to rename to something appropriate.
+ *        Returns TRUE if successful, FALSE otherwise */
+uint8_t PostTemplateTableHSM(ES_Event ThisEvent);
+
+
+/**
+ * @Function QueryTemplateTableHSM(void)
+ * @param none
+ * @return Current leaf state of the state machine
+ * @brief This function is a wrapper to return the current state of the state
+ *        machine. Return will match the ENUM above. Remember to rename to
+ *        something appropriate. */
+TemplateTableState_t QueryTemplateTableHSM(void);
+
+/**
+ * @Function RunTemplateTableHSM(ES_Event ThisEvent)
+ * @param ThisEvent - the event (type and param) to be responded.
+ * @return Event - return event (type and param), in general should be ES_NO_EVENT
+ * @brief This function hands the event to ES_HSM_Dispatch, which offers it to
+ *        the handler of the current state and then to the handlers of its
+ *        parents until one consumes it. A handler asks for a transition with
+ *        ES_HSM_Transition, and the exits and entries are then sent in order
+ *        without calling this function again.
+ * @note Remember to rename to something appropriate. */
+ES_Event RunTemplateTableHSM(ES_Event ThisEvent);
+
+#endif /* TABLE_HSM_Template_H */
+
@@ -17,17 +17,32 @@
 #include <BOARD.h>
 
 /*----------------------------- Module Defines ----------------------------*/
-// QueueSize is max number of entries in the queue
-// CurrentIndex is the 'read-from' index,
-// actually CurrentIndex + sizeof(EF_Queue_t)
-// entries are made to CurrentIndex + NumEntries + sizeof(ES_Queue_t)
-typedef struct {  unsigned char QueueSize;
-                  unsigned char CurrentIndex;
-                  unsigned char NumEntries;
+// the queue is a power of two sized circular buffer, so Mask is the number
+// of entries minus one. Head and Tail are free running counts of the entries
+// written and read, and are only ever reduced to an index with Mask, so
+// Head - Tail is the number of entries and no count is shared between the
+// two sides. Only a producer moves Head and only the consumer moves Tail.
+// Reserve is the count of entries claimed by producers, which is ahead of
+// Head while a multiple producer post is part way through.
+// entries are made to pBlock[1 + (Head & Mask)], just past the ES_Queue_t.
+// A block too small for any entries gets a Mask of 0xFF, so Mask + 1 as a
+// uint8_t is 0 and the room checks always find it full.
+typedef struct {  uint8_t Mask;
+                  volatile uint8_t Head;
+                  volatile uint8_t Tail;
+                  volatile uint8_t Reserve;
 } ES_Queue_t;
 
 typedef ES_Queue_t * pQueue_t;
 
+// the queue header takes the place of the first entry in the block, so it
+// must be no bigger than an ES_Event in either layout
+typedef char ES_QueueHeaderFits[(sizeof(ES_Queue_t) <= sizeof(ES_Event)) ? 1 : -1];
+
+// makes sure the entry is written before a new Head makes it visible, and
+// read before a new Tail lets a producer reuse it
+#define ES_QueueBarrier() __sync_synchronize()
+
 /*---------------------------- Module Functions ---------------------------*/
 
 /*---------------------------- Module Variables ---------------------------*/
@@ -46,22 +61,32 @@ typedef ES_Queue_t * pQueue_t;
  Notes
    you should pass it a block that is at least sizeof(ES_Queue_t) larger than 
    the number of entries that you want in the queue. Since the size of an 
-   ES_Event (at 4 bytes; 2 enum, 2 param) is greater than the 
-   sizeof(ES_Queue_t), you only need to declare an array of ES_Event
+   ES_Event (at 4 bytes; 2 type, 2 param, or 8 with ES_WIDE_EVENT_PARAM) is
+   at least the sizeof(ES_Queue_t), you only need to declare an array of ES_Event
    with 1 more element than you need for the actual queue.
+   the number of entries is rounded down to a power of two (at most 128),
+   ES_QUEUE_BLOCK_SIZE(n) gives a block size that holds at least n. A block
+   of less than 2 holds none, 0 is returned and the queue is always full
  Author
    J. Edward Carryer, 08/09/11, 18:40
 ****************************************************************************/
 uint8_t ES_InitQueue( ES_Event * pBlock, unsigned char BlockSize )
 {
    pQueue_t pThisQueue;
+   uint8_t NumEntries = 128;
    // initialize the Queue by setting up initial values for elements
    pThisQueue = (pQueue_t)pBlock;
-   // use all but the structure overhead as the Queue
-   pThisQueue->QueueSize = BlockSize - 1;
-   pThisQueue->CurrentIndex = 0;
-   pThisQueue->NumEntries = 0;
-   return(pThisQueue->QueueSize);
+   // use all but the structure overhead as the Queue, in a power of two
+   if (BlockSize < 2)
+      NumEntries = 0;
+   else
+      while (NumEntries > (BlockSize - 1))
+         NumEntries >>= 1;
+   pThisQueue->Mask = NumEntries - 1;
+   pThisQueue->Head = 0;
+   pThisQueue->Tail = 0;
+   pThisQueue->Reserve = 0;
+   return(NumEntries);
 }
 
 /****************************************************************************
@@ -75,30 +100,110 @@ uint8_t ES_InitQueue( ES_Event * pBlock, unsigned char BlockSize )
  Description
    if it will fit, adds Event2Add to the Queue
  Notes
-
+   single producer: safe against a consumer in another context (main line
+   vs interrupt) without turning interrupts off, as long as only one context
+   ever adds to this queue. Use ES_EnQueueFIFOMulti for a queue that is
+   added to from more than one context.
   Author
    J. Edward Carryer, 08/09/11, 18:59
 ****************************************************************************/
 uint8_t ES_EnQueueFIFO( ES_Event * pBlock, ES_Event Event2Add )
 {
    pQueue_t pThisQueue;
+   uint8_t Head;
    pThisQueue = (pQueue_t)pBlock;
-   // index will go from 0 to QueueSize-1 so use '<'
-   if ( pThisQueue->NumEntries < pThisQueue->QueueSize)
-   {  // save the new event, use % to create circular buffer in block
+   Head = pThisQueue->Head;
+   // full when Head is a whole queue ahead of Tail
+   if ( (uint8_t)(Head - pThisQueue->Tail) < (uint8_t)(pThisQueue->Mask + 1))
+   {  // save the new event, the mask wraps the count into the buffer
       // 1+ to step past the Queue struct at the beginning of the
       // block
-      //EnterCritical();   // save interrupt state, turn ints off
-      pBlock[ 1 + ((pThisQueue->CurrentIndex + pThisQueue->NumEntries)
-               % pThisQueue->QueueSize)] = Event2Add;
-      pThisQueue->NumEntries++;          // inc number of entries
-      //ExitCritical();  // restore saved interrupt state
-      
+      pBlock[ 1 + (Head & pThisQueue->Mask)] = Event2Add;
+      ES_QueueBarrier();
+      pThisQueue->Reserve = Head + 1;
+      pThisQueue->Head = Head + 1;       // publish the new entry
       return(TRUE);
    }else
       return(FALSE);
 }
 
+/****************************************************************************
+ Function
+   ES_EnQueueFIFOMulti
+ Parameters
+   ES_Event * pBlock : pointer to the block of memory in use as the Queue
+   ES_Event Event2Add : event to be added to the Queue
+ Returns
+   uint8_t : TRUE if the add was successful, FALSE if not
+ Description
+   if it will fit, adds Event2Add to the Queue. Any number of contexts
+   (the main line and several interrupts) may add to the same queue.
+ Notes
+   a producer first claims a slot by moving Reserve with a compare and swap,
+   then writes it. Only the producer whose slot is at Head publishes, and it
+   moves Head up to Reserve, past any slots claimed and written by producers
+   that interrupted it. This relies on interrupts nesting on a single core,
+   as they do on the PIC32: a producer that interrupts another one always
+   finishes before the interrupted one carries on.
+****************************************************************************/
+uint8_t ES_EnQueueFIFOMulti( ES_Event * pBlock, ES_Event Event2Add )
+{
+   pQueue_t pThisQueue;
+   uint8_t Slot;
+   pThisQueue = (pQueue_t)pBlock;
+   // claim a slot
+   do {
+      Slot = pThisQueue->Reserve;
+      if ( (uint8_t)(Slot - pThisQueue->Tail) >= (uint8_t)(pThisQueue->Mask + 1))
+         return(FALSE);
+   } while (!__sync_bool_compare_and_swap(&pThisQueue->Reserve, Slot, (uint8_t)(Slot + 1)));
+   pBlock[ 1 + (Slot & pThisQueue->Mask)] = Event2Add;
+   ES_QueueBarrier();
+   // publish ours and everything claimed since, if all before ours is done
+   if (pThisQueue->Head == Slot) {
+      do {
+         Slot = pThisQueue->Reserve;
+         pThisQueue->Head = Slot;
+      } while (Slot != pThisQueue->Reserve);
+   }
+   return(TRUE);
+}
+
+/****************************************************************************
+ Function
+   ES_EnQueueLIFO
+ Parameters
+   ES_Event * pBlock : pointer to the block of memory in use as the Queue
+   ES_Event Event2Add : event to be added to the Queue
+ Returns
+   uint8_t : TRUE if the add was successful, FALSE if not
+ Description
+   if it will fit, adds Event2Add to the front of the Queue, so that it is
+   the next one taken out
+ Notes
+   only for the context that takes entries from the queue. It moves Tail
+   back, which producers check for room, so interrupts are off while it does
+****************************************************************************/
+uint8_t ES_EnQueueLIFO( ES_Event * pBlock, ES_Event Event2Add )
+{
+   pQueue_t pThisQueue;
+   uint8_t Tail;
+   uint8_t ReturnVal = FALSE;
+   pThisQueue = (pQueue_t)pBlock;
+   EnterCritical();
+   Tail = pThisQueue->Tail;
+   // room counts the slots claimed by producers but not yet published
+   if ( (uint8_t)(pThisQueue->Reserve - Tail) < (uint8_t)(pThisQueue->Mask + 1))
+   {
+      Tail--;
+      pBlock[ 1 + (Tail & pThisQueue->Mask)] = Event2Add;
+      pThisQueue->Tail = Tail;
+      ReturnVal = TRUE;
+   }
+   ExitCritical();
+   return(ReturnVal);
+}
+
 
 /****************************************************************************
  Function
@@ -112,34 +217,65 @@ uint8_t ES_EnQueueFIFO( ES_Event * pBlock, ES_Event Event2Add )
    pulls next available entry from Queue, EF_NO_EVENT if Queue was empty and
    copies it to *pReturnEvent.
  Notes
-
+   single consumer: only one context may take entries from a queue
  Author
    J. Edward Carryer, 08/09/11, 19:11
 ****************************************************************************/
 uint8_t ES_DeQueue( ES_Event * pBlock, ES_Event * pReturnEvent )
 {
    pQueue_t pThisQueue;
-   uint8_t NumLeft;
+   uint8_t Tail;
+
+   pThisQueue = (pQueue_t)pBlock;
+   Tail = pThisQueue->Tail;
+   if ( pThisQueue->Head != Tail)
+   {
+      *pReturnEvent = pBlock[ 1 + (Tail & pThisQueue->Mask) ];
+      ES_QueueBarrier();
+      // inc the count, the mask takes care of the wrap around
+      pThisQueue->Tail = ++Tail;
+      return (uint8_t)(pThisQueue->Head - Tail);
+   }else { // no items left in the queue
+      (*pReturnEvent).EventType = ES_NO_EVENT;
+      (*pReturnEvent).EventParam = 0;
+      return 0;
+   }
+}
+
+/****************************************************************************
+ Function
+   ES_DeQueueLIFO
+ Parameters
+   unsigned char * pBlock : pointer to the block of memory in use as the Queue
+   ES_Event * pReturnEvent : used to return the event pulled from the queue
+ Returns
+   The number of entries remaining in the Queue
+ Description
+   pulls the most recently added entry from Queue, EF_NO_EVENT if Queue was
+   empty and copies it to *pReturnEvent.
+ Notes
+   only for queues that are posted to and taken from by the same context,
+   such as a deferral queue, since it moves Head back
+****************************************************************************/
+uint8_t ES_DeQueueLIFO( ES_Event * pBlock, ES_Event * pReturnEvent )
+{
+   pQueue_t pThisQueue;
+   uint8_t Head;
 
    pThisQueue = (pQueue_t)pBlock;
-   if ( pThisQueue->NumEntries > 0)
+   Head = pThisQueue->Head;
+   if ( Head != pThisQueue->Tail)
    {
-      EnterCritical();   // save interrupt state, turn ints off
-      *pReturnEvent = pBlock[ 1 + pThisQueue->CurrentIndex ];
-      // inc the index
-      pThisQueue->CurrentIndex++;
-      // this way we only do the modulo operation when we really need to
-      if (pThisQueue->CurrentIndex >=  pThisQueue->QueueSize)
-         pThisQueue->CurrentIndex = (unsigned char)(pThisQueue->CurrentIndex % pThisQueue->QueueSize);
-      //dec number of elements since we took 1 out
-      NumLeft = --pThisQueue->NumEntries; 
-      ExitCritical();  // restore saved interrupt state
+      Head--;
+      *pReturnEvent = pBlock[ 1 + (Head & pThisQueue->Mask) ];
+      pThisQueue->Reserve = Head;
+      pThisQueue->Head = Head;
+      return (uint8_t)(Head - pThisQueue->Tail);
    }else { // no items left in the queue
       (*pReturnEvent).EventType = ES_NO_EVENT;
       (*pReturnEvent).EventParam = 0;
-      NumLeft = 0;
+      return 0;
    }
-   return NumLeft;
 }
 
 /****************************************************************************
@@ -161,7 +297,128 @@ uint8_t ES_IsQueueEmpty( ES_Event * pBlock )
    pQueue_t pThisQueue;
 
    pThisQueue = (pQueue_t)pBlock;
-   return(pThisQueue->NumEntries == 0);
+   return(pThisQueue->Head == pThisQueue->Tail);
+}
+
+/****************************************************************************
+ Function
+   ES_QueueCount
+ Parameters
+   unsigned char * pBlock : pointer to the block of memory in use as the Queue
+ Returns
+   uint8_t : number of entries currently in the Queue
+ Description
+   see above
+ Notes
+   only a snapshot if other contexts are posting to or taking from the queue
+****************************************************************************/
+uint8_t ES_QueueCount( ES_Event * pBlock )
+{
+   pQueue_t pThisQueue;
+
+   pThisQueue = (pQueue_t)pBlock;
+   return (uint8_t)(pThisQueue->Head - pThisQueue->Tail);
+}
+
+/****************************************************************************
+ Function
+   ES_QueueRoom
+ Parameters
+   unsigned char * pBlock : pointer to the block of memory in use as the Queue
+ Returns
+   uint8_t : number of entries that can still be added to the Queue
+ Description
+   see above
+ Notes
+   slots claimed by a producer part way through an add are not free. With
+   interrupts off, that many adds are sure to succeed.
+****************************************************************************/
+uint8_t ES_QueueRoom( ES_Event * pBlock )
+{
+   pQueue_t pThisQueue;
+
+   pThisQueue = (pQueue_t)pBlock;
+   return (uint8_t)(pThisQueue->Mask + 1 -
+                    (uint8_t)(pThisQueue->Reserve - pThisQueue->Tail));
+}
+
+/****************************************************************************
+ Function
+   ES_QueueNextEntry
+ Parameters
+   unsigned char * pBlock : pointer to the block of memory in use as the Queue
+ Returns
+   uint8_t : the entry number the next add to the Queue will get
+ Description
+   entry numbers are free running counts, pass one to ES_CoalesceQueued
+ Notes
+   only meaningful if nothing else can add to the queue before the add
+   that it is used for, ie with interrupts off
+****************************************************************************/
+uint8_t ES_QueueNextEntry( ES_Event * pBlock )
+{
+   pQueue_t pThisQueue;
+
+   pThisQueue = (pQueue_t)pBlock;
+   return pThisQueue->Reserve;
+}
+
+/****************************************************************************
+ Function
+   ES_QueueNextOut
+ Parameters
+   unsigned char * pBlock : pointer to the block of memory in use as the Queue
+ Returns
+   uint8_t : the entry number of the event the next ES_DeQueue will take
+ Description
+   the same numbering as ES_QueueNextEntry, so the consumer can tell which
+   add an event it takes out came from
+ Notes
+   call from the consumer, before the ES_DeQueue
+****************************************************************************/
+uint8_t ES_QueueNextOut( ES_Event * pBlock )
+{
+   pQueue_t pThisQueue;
+
+   pThisQueue = (pQueue_t)pBlock;
+   return pThisQueue->Tail;
+}
+
+/****************************************************************************
+ Function
+   ES_CoalesceQueued
+ Parameters
+   unsigned char * pBlock : pointer to the block of memory in use as the Queue
+   uint8_t Entry : entry number of an earlier add, from ES_QueueNextEntry
+   ES_Event NewEvent : the event to merge into that entry
+ Returns
+   uint8_t : TRUE if the entry was still waiting and took NewEvent's
+             EventParam, FALSE if it has been taken out or was replaced
+ Description
+   merges NewEvent into an entry still in the Queue rather than adding it
+ Notes
+   the entry next out of the queue is left alone, the consumer may be
+   copying it. Call with interrupts off so no other producer can merge
+   into the same entry at the same time.
+****************************************************************************/
+uint8_t ES_CoalesceQueued( ES_Event * pBlock, uint8_t Entry, ES_Event NewEvent )
+{
+   pQueue_t pThisQueue;
+   uint8_t Tail;
+   ES_Event *pEntry;
+
+   pThisQueue = (pQueue_t)pBlock;
+   Tail = pThisQueue->Tail;
+   // must be past the next one out but before Head
+   if ( ((uint8_t)(Entry - Tail) == 0) ||
+        ((uint8_t)(Entry - Tail) >= (uint8_t)(pThisQueue->Head - Tail)))
+      return(FALSE);
+   pEntry = &pBlock[ 1 + (Entry & pThisQueue->Mask)];
+   // an entry number from a lap ago could land on some other event
+   if (pEntry->EventType != NewEvent.EventType)
+      return(FALSE);
+   pEntry->EventParam = NewEvent.EventParam;
+   return(TRUE);
 }
 
 #if 0
@@ -185,8 +442,7 @@ void QueueFlushQueue( unsigned char * pBlock )
    // doing this with a Queue structure is not strictly necessary
    // but makes it clearer what is going on.
    pThisQueue = (pQueue_t)pBlock;
-   pThisQueue->CurrentIndex = 0;
-   pThisQueue->NumEntries = 0;
+   pThisQueue->Tail = pThisQueue->Head;
    return;
 }
 
@@ -197,9 +453,751 @@ void QueueFlushQueue( unsigned char * pBlock )
  ***************************************************************************/
 
 /*------------------------------- Footnotes -------------------------------*/
-/*------------------------------ End of file ------------------------------*/
-
-
+#ifdef ES_QUEUE_STRESS_TEST
+/* Queue stress test. An interrupt fires every STRESS_ISR_TICKS core timer
+ * ticks and adds a numbered event to a queue that only it writes
+ * (ES_EnQueueFIFO) and another to a queue it shares with the main line
+ * (ES_EnQueueFIFOMulti). The main line adds its own numbered events to the
+ * shared queue as fast as it can and drains both queues. Every stream must
+ * arrive complete and in order, with nothing lost or repeated; a post refused
+ * because the queue was full is retried, not lost. First, blocks too small to
+ * hold an entry must give queues that are always full and never write past
+ * the block. On the PIC32 the interrupt
+ * is the core timer's. Built for a host it is SIGALRM from an interval timer,
+ * see projects_and_templates/HostTest, and the exit status is the result. */
+#include <stdio.h>
+#ifdef __PIC32MX__
+#include <xc.h>
+#include <peripheral/timer.h>
+
+#ifdef USE_TICKLESS_TIMERS
+#error "the stress test uses the core timer interrupt, undefine USE_TICKLESS_TIMERS"
+#endif
+#else
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+#define STRESS_ISR_TICKS 400
+#define STRESS_EVENTS 1000000UL
+
+static ES_Event StressIsrQueue[ES_QUEUE_BLOCK_SIZE(4)];
+static ES_Event StressSharedQueue[ES_QUEUE_BLOCK_SIZE(8)];
+static volatile uint16_t StressIsrSent, StressIsrSharedSent;
+static volatile uint32_t StressIsrFull;
+
+#ifdef __PIC32MX__
+void __ISR(_CORE_TIMER_VECTOR, ipl2auto) CoreTimerIntHandler(void)
+#else
+static void StressSignalHandler(int Signal)
+#endif
+{
+    ES_Event ThisEvent;
+#ifdef __PIC32MX__
+    mCTClearIntFlag();
+    UpdateCoreTimer(STRESS_ISR_TICKS);
+#endif
+    ThisEvent.EventType = ES_TIMEOUT;
+    ThisEvent.EventParam = StressIsrSent;
+    if (ES_EnQueueFIFO(StressIsrQueue, ThisEvent) == TRUE)
+        StressIsrSent++;
+    else
+        StressIsrFull++;
+    ThisEvent.EventType = ES_TIMERACTIVE;
+    ThisEvent.EventParam = StressIsrSharedSent;
+    if (ES_EnQueueFIFOMulti(StressSharedQueue, ThisEvent) == TRUE)
+        StressIsrSharedSent++;
+    else
+        StressIsrFull++;
+}
+
+// takes everything waiting in both queues, checking each stream's numbers
+static void StressDrain(uint16_t *pMainNext, uint16_t *pIsrNext,
+        uint16_t *pIsrSharedNext, uint32_t *pReceived, uint32_t *pErrors)
+{
+    ES_Event ThisEvent;
+
+    while (!ES_IsQueueEmpty(StressSharedQueue)) {
+        ES_DeQueue(StressSharedQueue, &ThisEvent);
+        (*pReceived)++;
+        if (ThisEvent.EventType == ES_KEYINPUT) {
+            if (ThisEvent.EventParam != (*pMainNext)++)
+                (*pErrors)++;
+        } else if (ThisEvent.EventParam != (*pIsrSharedNext)++)
+            (*pErrors)++;
+    }
+    while (!ES_IsQueueEmpty(StressIsrQueue)) {
+        ES_DeQueue(StressIsrQueue, &ThisEvent);
+        (*pReceived)++;
+        if (ThisEvent.EventParam != (*pIsrNext)++)
+            (*pErrors)++;
+    }
+}
+
+// a block of 0 or 1 events has no room past the header, so every add must be
+// refused and the event after the block left alone
+static uint32_t StressTinyQueues(void)
+{
+    ES_Event Tiny[2];
+    ES_Event ThisEvent = {ES_KEYINPUT, 0x5A};
+    uint32_t Errors = 0;
+    uint8_t BlockSize;
+
+    for (BlockSize = 0; BlockSize < 2; BlockSize++) {
+        Tiny[1].EventType = ES_NO_EVENT;
+        if ((ES_InitQueue(Tiny, BlockSize) != 0) ||
+                (ES_EnQueueFIFO(Tiny, ThisEvent) == TRUE) ||
+                (ES_EnQueueFIFOMulti(Tiny, ThisEvent) == TRUE) ||
+                (ES_EnQueueLIFO(Tiny, ThisEvent) == TRUE) ||
+                (ES_QueueRoom(Tiny) != 0) || !ES_IsQueueEmpty(Tiny) ||
+                (Tiny[1].EventType != ES_NO_EVENT)) {
+            Errors++;
+        }
+    }
+    printf("blocks of 0 and 1: %lu errors\r\n", (unsigned long) Errors);
+    return Errors;
+}
+
+int main(void)
+{
+    ES_Event ThisEvent;
+    uint16_t MainSent = 0, MainNext = 0, IsrNext = 0, IsrSharedNext = 0;
+    uint32_t Received = 0, Errors = 0, MainFull = 0;
+#ifndef __PIC32MX__
+    struct itimerval Interval = {{0, STRESS_ISR_TICKS / ES_RUN_CLOCK_TICKS_PER_US},
+                                 {0, STRESS_ISR_TICKS / ES_RUN_CLOCK_TICKS_PER_US}};
+    struct itimerval Off = {{0, 0}, {0, 0}};
+#endif
+
+    BOARD_Init();
+    printf("Queue stress test, interrupt every %d core ticks\r\n", STRESS_ISR_TICKS);
+    Errors = StressTinyQueues();
+    ES_InitQueue(StressIsrQueue, ARRAY_SIZE(StressIsrQueue));
+    ES_InitQueue(StressSharedQueue, ARRAY_SIZE(StressSharedQueue));
+#ifdef __PIC32MX__
+    OpenCoreTimer(STRESS_ISR_TICKS);
+    mConfigIntCoreTimer(CT_INT_ON | CT_INT_PRIOR_2);
+#else
+    signal(SIGALRM, StressSignalHandler);
+    setitimer(ITIMER_REAL, &Interval, NULL);
+#endif
+
+    while (Received < STRESS_EVENTS) {
+        ThisEvent.EventType = ES_KEYINPUT;
+        ThisEvent.EventParam = MainSent;
+        if (ES_EnQueueFIFOMulti(StressSharedQueue, ThisEvent) == TRUE)
+            MainSent++;
+        else
+            MainFull++;
+        StressDrain(&MainNext, &IsrNext, &IsrSharedNext, &Received, &Errors);
+    }
+#ifdef __PIC32MX__
+    mConfigIntCoreTimer(CT_INT_OFF);
+#else
+    setitimer(ITIMER_REAL, &Off, NULL);
+#endif
+    // whatever is left over, then every event sent must have been received
+    StressDrain(&MainNext, &IsrNext, &IsrSharedNext, &Received, &Errors);
+    if ((MainNext != MainSent) || (IsrNext != StressIsrSent) ||
+            (IsrSharedNext != StressIsrSharedSent))
+        Errors++;
+    printf("%lu events, %lu out of order or missing, %lu/%lu posts found a full queue\r\n",
+            (unsigned long) Received, (unsigned long) Errors,
+            (unsigned long) StressIsrFull, (unsigned long) MainFull);
+#ifdef __PIC32MX__
+    while (1);
+#else
+    return (Errors == 0) ? 0 : 1;
+#endif
+}
+#endif
+/*------------------------------ End of file ------------------------------*/
+
+
+/****************************************************************************
+ Module
+     ES_Payload.c
+ Description
+     fixed size block pools for the data carried by PAYLOAD_EVENTS. The
+     event's EventParam holds a handle to the block, so the data is never
+     copied from one service to the next.
+ Notes
+     Each pool keeps a free mask with one bit per block, so alloc and free
+     are a count leading zeros and a compare and swap, and are safe from
+     interrupts without turning them off. Every queue a payload event is
+     posted to holds a reference, ES_Run drops it once the run function
+     returns, and the block goes back to its pool with the last reference.
+*****************************************************************************/
+/*----------------------------- Include Files -----------------------------*/
+#include <stddef.h>
+
+/*----------------------------- Module Defines ----------------------------*/
+#if NUM_PAYLOAD_POOLS > 0
+
+typedef struct {
+    uint32_t *pMem; // the blocks, one after another
+    uint16_t BlockWords; // size of a block in 32 bit words
+    uint8_t NumBlocks; // how many blocks
+    volatile uint8_t *pRefs; // a reference count for each block
+} ES_PayloadPool_t;
+
+#define PAYLOAD_WORDS(SIZE) (((SIZE) + 3) / 4)
+
+/*---------------------------- Module Variables ---------------------------*/
+// the blocks and reference counts for each pool in PAYLOAD_POOLS, named by
+// block size, so the sizes must all be different
+
+#define PAYLOAD_MEM_FORM(SIZE, COUNT) \
+    static uint32_t PayloadMem_##SIZE[COUNT][PAYLOAD_WORDS(SIZE)]; \
+    static volatile uint8_t PayloadRefs_##SIZE[COUNT];
+PAYLOAD_POOLS(PAYLOAD_MEM_FORM)
+
+#define PAYLOAD_POOL_FORM(SIZE, COUNT) \
+    {&PayloadMem_##SIZE[0][0], PAYLOAD_WORDS(SIZE), COUNT, PayloadRefs_##SIZE},
+static ES_PayloadPool_t const PayloadPools[NUM_PAYLOAD_POOLS] = {
+    PAYLOAD_POOLS(PAYLOAD_POOL_FORM)
+};
+
+// bit n set means block n of the pool is free
+static volatile uint32_t PayloadFree[NUM_PAYLOAD_POOLS];
+
+// TRUE for the event types that carry a payload handle
+#define PAYLOAD_EVENT_FORM(EVENT) [EVENT] = TRUE,
+static uint8_t const PayloadEvent[NUMBEROFEVENTS] = {
+    PAYLOAD_EVENTS(PAYLOAD_EVENT_FORM)
+};
+
+// a pool's free mask has a bit per block
+#define PAYLOAD_BLOCKS_CHECK_FORM(SIZE, COUNT) \
+    typedef char PayloadPool_##SIZE##_Fits[(COUNT) <= 32 ? 1 : -1];
+PAYLOAD_POOLS(PAYLOAD_BLOCKS_CHECK_FORM)
+
+/*------------------------------ Module Code ------------------------------*/
+/****************************************************************************
+ Function
+   ES_InitPayloads
+ Parameters
+   None
+ Returns
+   None
+ Description
+   marks every block of every pool free
+ Notes
+   called by ES_Initialize
+****************************************************************************/
+void ES_InitPayloads( void )
+{
+   uint8_t i;
+   for (i = 0; i < NUM_PAYLOAD_POOLS; i++) {
+      PayloadFree[i] = (PayloadPools[i].NumBlocks == 32) ? 0xFFFFFFFF :
+            (((uint32_t)1 << PayloadPools[i].NumBlocks) - 1);
+   }
+}
+
+/****************************************************************************
+ Function
+   ES_PayloadAlloc
+ Parameters
+   uint16_t Size : number of bytes needed
+ Returns
+   uint16_t : handle of the block, ES_NO_PAYLOAD if none are free
+ Description
+   takes a free block from the smallest pool that fits Size, falling back
+   to bigger pools when it is empty
+ Notes
+   the block has no references until it is posted. Put the handle in the
+   EventParam of one of PAYLOAD_EVENTS and post it; if it is never posted
+   call ES_PayloadRelease to give it back.
+****************************************************************************/
+uint16_t ES_PayloadAlloc( uint16_t Size )
+{
+   uint8_t i, Block;
+   uint32_t Free;
+   for (i = 0; i < NUM_PAYLOAD_POOLS; i++) {
+      if (((uint32_t)PayloadPools[i].BlockWords * 4) < Size)
+         continue;
+      do {
+         Free = PayloadFree[i];
+         if (Free == 0)
+            break;
+         Block = 31 - __builtin_clz(Free);
+      } while (!__sync_bool_compare_and_swap(&PayloadFree[i], Free,
+               Free & ~((uint32_t)1 << Block)));
+      if (Free != 0) {
+         PayloadPools[i].pRefs[Block] = 0;
+         return ((uint16_t)i << 8) | Block;
+      }
+   }
+   return ES_NO_PAYLOAD;
+}
+
+/****************************************************************************
+ Function
+   ES_PayloadPtr
+ Parameters
+   uint16_t Handle : from ES_PayloadAlloc, usually an event's EventParam
+ Returns
+   void * : the block, word aligned, NULL for a bad handle
+ Description
+   see above
+ Notes
+   a run function may use the block until it returns, after that it may
+   already be reused
+****************************************************************************/
+void * ES_PayloadPtr( uint16_t Handle )
+{
+   uint8_t Pool = Handle >> 8, Block = Handle & 0xFF;
+   if ((Pool >= NUM_PAYLOAD_POOLS) || (Block >= PayloadPools[Pool].NumBlocks))
+      return NULL;
+   return &PayloadPools[Pool].pMem[(uint16_t)Block * PayloadPools[Pool].BlockWords];
+}
+
+/****************************************************************************
+ Function
+   ES_PayloadRetain
+ Parameters
+   uint16_t Handle : from ES_PayloadAlloc
+ Returns
+   None
+ Description
+   adds a reference to the block
+ Notes
+   done for you by every post of a payload event, and by ES_DeferEvent
+****************************************************************************/
+void ES_PayloadRetain( uint16_t Handle )
+{
+   uint8_t Pool = Handle >> 8, Block = Handle & 0xFF;
+   if ((Pool >= NUM_PAYLOAD_POOLS) || (Block >= PayloadPools[Pool].NumBlocks))
+      return;
+   __sync_fetch_and_add(&PayloadPools[Pool].pRefs[Block], 1);
+}
+
+/****************************************************************************
+ Function
+   ES_PayloadRelease
+ Parameters
+   uint16_t Handle : from ES_PayloadAlloc
+ Returns
+   None
+ Description
+   drops a reference to the block, and frees it when none are left
+ Notes
+   done for you by ES_Run after the run function returns. A block that
+   was never posted has no references and is freed straight away.
+****************************************************************************/
+void ES_PayloadRelease( uint16_t Handle )
+{
+   uint8_t Pool = Handle >> 8, Block = Handle & 0xFF;
+   uint8_t Refs;
+   if ((Pool >= NUM_PAYLOAD_POOLS) || (Block >= PayloadPools[Pool].NumBlocks))
+      return;
+   do {
+      Refs = PayloadPools[Pool].pRefs[Block];
+      if (Refs == 0)
+         break;
+   } while (!__sync_bool_compare_and_swap(&PayloadPools[Pool].pRefs[Block],
+            Refs, Refs - 1));
+   if (Refs <= 1) // that was the last one
+      __sync_fetch_and_or(&PayloadFree[Pool], (uint32_t)1 << Block);
+}
+
+/****************************************************************************
+ Function
+   ES_IsPayloadEvent
+ Parameters
+   ES_Event ThisEvent : any event
+ Returns
+   uint8_t : TRUE if its type is one of PAYLOAD_EVENTS
+ Description
+   see above
+ Notes
+
+****************************************************************************/
+uint8_t ES_IsPayloadEvent( ES_Event ThisEvent )
+{
+   return (ThisEvent.EventType < NUMBEROFEVENTS) &&
+         PayloadEvent[ThisEvent.EventType];
+}
+
+#endif /* NUM_PAYLOAD_POOLS > 0 */
+/*------------------------------ End of file ------------------------------*/
+
+
+/****************************************************************************
+ Module
+     ES_HSM.c
+ Description
+     table driven hierarchical state machines. Each state is an entry in a
+     const table giving its handler, its parent and its initial child, so
+     an event is offered to the current leaf and then to each ancestor in
+     turn, and a transition is worked out from the table rather than by
+     calling the machine's run function again at every level.
+ Notes
+     A transition finds the least common ancestor of the source and target
+     by walking up the Parent links, sends ES_EXIT from the current leaf up
+     to it, ES_ENTRY from it down to the target, and then follows the
+     InitialChild links down to a leaf. All of it is done with loops, so the
+     stack used does not grow with the depth of the machine. A transition
+     to the source itself, or to one of its ancestors or children, leaves
+     and re-enters the source. Transitions asked for from ES_ENTRY or
+     ES_EXIT are ignored.
+*****************************************************************************/
+/*----------------------------- Include Files -----------------------------*/
+
+/*---------------------------- Module Functions ---------------------------*/
+static uint8_t StateDepth(const ES_HSMState_t *pStates, uint8_t State);
+static void ChangeState(ES_HSM_t *pMe, uint8_t Source, uint8_t Target);
+
+/*------------------------------ Module Code ------------------------------*/
+/****************************************************************************
+ Function
+   ES_HSM_Init
+ Parameters
+   ES_HSM_t *pMachine : the machine to set up
+   const ES_HSMState_t *pStates : its state table
+   uint8_t Initial : the initial pseudo-state
+ Returns
+   None
+ Description
+   puts the machine in its initial pseudo-state, whose handler should make
+   the transition into the real initial state on ES_INIT
+ Notes
+   no ES_ENTRY is sent to the initial pseudo-state, and no ES_EXIT either
+   when its handler makes the transition out of it on ES_INIT
+****************************************************************************/
+void ES_HSM_Init(ES_HSM_t *pMachine, const ES_HSMState_t *pStates,
+        uint8_t Initial)
+{
+   pMachine->pStates = pStates;
+   pMachine->Current = Initial;
+   pMachine->Target = ES_HSM_NO_STATE;
+   pMachine->Started = FALSE;
+}
+
+/****************************************************************************
+ Function
+   ES_HSM_Dispatch
+ Parameters
+   ES_HSM_t *pMachine : the machine to run
+   ES_Event ThisEvent : the event to handle
+ Returns
+   ES_Event : ES_NO_EVENT if some state handled the event, otherwise the
+      event, so the caller can pass it on
+ Description
+   offers the event to the current leaf state and then to its ancestors
+   until one of them consumes it or asks for a transition, then makes the
+   transition
+ Notes
+   a handler that calls ES_HSM_Transition has consumed the event, whatever
+   it returns
+****************************************************************************/
+ES_Event ES_HSM_Dispatch(ES_HSM_t *pMachine, ES_Event ThisEvent)
+{
+   uint8_t State = pMachine->Current;
+
+   pMachine->Target = ES_HSM_NO_STATE;
+   while (State != ES_HSM_NO_STATE) {
+      ThisEvent = pMachine->pStates[State].Handler(pMachine, ThisEvent);
+      if (pMachine->Target != ES_HSM_NO_STATE) {
+         ChangeState(pMachine, State, pMachine->Target);
+         ThisEvent.EventType = ES_NO_EVENT;
+         break;
+      }
+      if (ThisEvent.EventType == ES_NO_EVENT)
+         break;
+      State = pMachine->pStates[State].Parent;
+   }
+   return ThisEvent;
+}
+
+/****************************************************************************
+ Function
+   ES_HSM_Transition
+ Parameters
+   ES_HSM_t *pMachine : the machine handling an event
+   uint8_t Target : the state to go to
+ Returns
+   None
+ Description
+   called from a handler to ask for a transition, which ES_HSM_Dispatch
+   makes once the handler returns
+ Notes
+   the last call made while handling an event wins
+****************************************************************************/
+void ES_HSM_Transition(ES_HSM_t *pMachine, uint8_t Target)
+{
+   pMachine->Target = Target;
+}
+
+/****************************************************************************
+ Function
+   ES_HSM_GetState
+ Parameters
+   const ES_HSM_t *pMachine : the machine to look at
+ Returns
+   uint8_t : the leaf state the machine is in
+ Description
+   see above
+ Notes
+
+****************************************************************************/
+uint8_t ES_HSM_GetState(const ES_HSM_t *pMachine)
+{
+   return pMachine->Current;
+}
+
+/****************************************************************************
+ Function
+   ES_HSM_IsInState
+ Parameters
+   const ES_HSM_t *pMachine : the machine to look at
+   uint8_t State : any state in its table
+ Returns
+   uint8_t : TRUE if State is the current leaf or one of its ancestors
+ Description
+   see above
+ Notes
+
+****************************************************************************/
+uint8_t ES_HSM_IsInState(const ES_HSM_t *pMachine, uint8_t State)
+{
+   uint8_t Here = pMachine->Current;
+
+   while (Here != ES_HSM_NO_STATE) {
+      if (Here == State)
+         return TRUE;
+      Here = pMachine->pStates[Here].Parent;
+   }
+   return FALSE;
+}
+
+/***************************************************************************
+ private functions
+ ***************************************************************************/
+/****************************************************************************
+ Function
+   StateDepth
+ Parameters
+   const ES_HSMState_t *pStates : the state table
+   uint8_t State : a state in it
+ Returns
+   uint8_t : how many ancestors State has, 0 for a top level state
+ Description
+   see above
+ Notes
+
+****************************************************************************/
+static uint8_t StateDepth(const ES_HSMState_t *pStates, uint8_t State)
+{
+   uint8_t Depth = 0;
+
+   while (pStates[State].Parent != ES_HSM_NO_STATE) {
+      State = pStates[State].Parent;
+      Depth++;
+   }
+   return Depth;
+}
+
+/****************************************************************************
+ Function
+   ChangeState
+ Parameters
+   ES_HSM_t *pMe : the machine
+   uint8_t Source : the state whose handler asked for the transition
+   uint8_t Target : the state to go to
+ Returns
+   None
+ Description
+   exits up to the least common ancestor of Source and Target, enters down
+   to Target and then down its initial children to a leaf
+ Notes
+   Entering walks up from Target each time to find the next state down,
+   which is cheaper than a path array for the shallow machines used here
+   and puts no limit on the depth. The first transition, out of the
+   initial pseudo-state, exits nothing, as nothing had been entered.
+****************************************************************************/
+static void ChangeState(ES_HSM_t *pMe, uint8_t Source, uint8_t Target)
+{
+   const ES_HSMState_t *pStates = pMe->pStates;
+   uint8_t SourceDepth = StateDepth(pStates, Source);
+   uint8_t TargetDepth = StateDepth(pStates, Target);
+   uint8_t a = Source;
+   uint8_t b = Target;
+   uint8_t Lca;
+   uint8_t Next;
+
+   // bring both to the same depth, then climb together until they meet
+   for (; SourceDepth > TargetDepth; SourceDepth--)
+      a = pStates[a].Parent;
+   for (; TargetDepth > SourceDepth; TargetDepth--)
+      b = pStates[b].Parent;
+   while (a != b) {
+      a = pStates[a].Parent;
+      b = pStates[b].Parent;
+   }
+   Lca = a;
+   // a transition within one branch leaves and re-enters the outer state
+   if ((Lca == Source) || (Lca == Target))
+      Lca = pStates[Lca].Parent;
+
+   // exit from the leaf up to, but not including, the common ancestor
+   while (pMe->Current != Lca) {
+      if (pMe->Started)
+         pStates[pMe->Current].Handler(pMe, EXIT_EVENT);
+      pMe->Current = pStates[pMe->Current].Parent;
+   }
+   pMe->Started = TRUE;
+
+   // enter from just below the common ancestor down to the target
+   while (pMe->Current != Target) {
+      Next = Target;
+      while (pStates[Next].Parent != pMe->Current)
+         Next = pStates[Next].Parent;
+      pMe->Current = Next;
+      pStates[Next].Handler(pMe, ENTRY_EVENT);
+   }
+
+   // and on down the initial children to a leaf
+   while (pStates[pMe->Current].InitialChild != ES_HSM_NO_STATE) {
+      pMe->Current = pStates[pMe->Current].InitialChild;
+      pStates[pMe->Current].Handler(pMe, ENTRY_EVENT);
+   }
+   pMe->Target = ES_HSM_NO_STATE;
+}
+
+/*------------------------------- Footnotes -------------------------------*/
+#ifdef ES_HSM_TEST
+/* Transition order test. Every handler of a small machine writes what it was
+ * sent to a log, and each transition's log must match the exits and entries
+ * worked out by hand from the rule above: exit up to the least common
+ * ancestor, or to its parent when it is the source or the target, then enter
+ * down to a leaf. ES_KEYINPUT asks for a transition, from the state in the
+ * top byte of EventParam to the one in the bottom byte. The states are
+ *
+ *     Init (pseudo-state)    Outer
+ *                            +-- A (initial)
+ *                            |   +-- A1 (initial)
+ *                            |   +-- A2
+ *                            +-- B
+ *
+ * Built for a host, see projects_and_templates/HostTest, the exit status is
+ * the result. */
+#include <stdio.h>
+#include <string.h>
+
+enum { OrderInit, OrderOuter, OrderA, OrderA1, OrderA2, OrderB };
+
+static const char * const OrderNames[] = {"Init", "Outer", "A", "A1", "A2", "B"};
+static char OrderLog[200];
+
+static ES_Event OrderHandle(uint8_t State, ES_HSM_t *pMachine, ES_Event ThisEvent) {
+    const char *pType;
+
+    switch (ThisEvent.EventType) {
+        case ES_INIT: pType = "INIT";
+            break;
+        case ES_ENTRY: pType = "ENTRY";
+            break;
+        case ES_EXIT: pType = "EXIT";
+            break;
+        case ES_KEYINPUT: pType = "KEY";
+            break;
+        default: pType = "?";
+            break;
+    }
+    snprintf(OrderLog + strlen(OrderLog), sizeof (OrderLog) - strlen(OrderLog),
+            "%s%s:%s", (OrderLog[0] != '\0') ? " " : "", OrderNames[State], pType);
+    if ((State == OrderInit) && (ThisEvent.EventType == ES_INIT)) {
+        ES_HSM_Transition(pMachine, OrderOuter);
+        ThisEvent.EventType = ES_NO_EVENT;
+    } else if ((ThisEvent.EventType == ES_KEYINPUT) &&
+            ((ThisEvent.EventParam >> 8) == State)) {
+        ES_HSM_Transition(pMachine, ThisEvent.EventParam & 0xFF);
+        ThisEvent.EventType = ES_NO_EVENT;
+    }
+    return ThisEvent;
+}
+
+#define ORDER_HANDLER(STATE) \
+    static ES_Event STATE##Handler(ES_HSM_t *pMachine, ES_Event ThisEvent) { \
+        return OrderHandle(STATE, pMachine, ThisEvent); \
+    }
+ORDER_HANDLER(OrderInit)
+ORDER_HANDLER(OrderOuter)
+ORDER_HANDLER(OrderA)
+ORDER_HANDLER(OrderA1)
+ORDER_HANDLER(OrderA2)
+ORDER_HANDLER(OrderB)
+
+static const ES_HSMState_t OrderStates[] = {
+    {OrderInitHandler, ES_HSM_NO_STATE, ES_HSM_NO_STATE},
+    {OrderOuterHandler, ES_HSM_NO_STATE, OrderA},
+    {OrderAHandler, OrderOuter, OrderA1},
+    {OrderA1Handler, OrderA, ES_HSM_NO_STATE},
+    {OrderA2Handler, OrderA, ES_HSM_NO_STATE},
+    {OrderBHandler, OrderOuter, ES_HSM_NO_STATE},
+};
+
+// dispatches one event and checks the handler calls it made and the leaf
+// the machine ends up in
+static uint8_t OrderCheck(ES_HSM_t *pMachine, const char *pCase, ES_Event ThisEvent,
+        const char *pExpected, uint8_t Leaf) {
+    uint8_t Passed;
+
+    OrderLog[0] = '\0';
+    ES_HSM_Dispatch(pMachine, ThisEvent);
+    Passed = (strcmp(OrderLog, pExpected) == 0) && (ES_HSM_GetState(pMachine) == Leaf);
+    printf("%s: %s\r\n", pCase, Passed ? "passed" : "FAILED");
+    if (!Passed)
+        printf("    got %s, in %s\r\n    not %s, in %s\r\n", OrderLog,
+            OrderNames[ES_HSM_GetState(pMachine)], pExpected, OrderNames[Leaf]);
+    return Passed;
+}
+
+static ES_Event OrderKey(uint8_t Source, uint8_t Target) {
+    ES_Event ThisEvent;
+
+    ThisEvent.EventType = ES_KEYINPUT;
+    ThisEvent.EventParam = (Source << 8) | Target;
+    return ThisEvent;
+}
+
+int main(void) {
+    ES_HSM_t Machine;
+    ES_Event ThisEvent;
+    uint8_t Passed = TRUE;
+
+    BOARD_Init();
+    printf("HSM transition order test\r\n");
+    ES_HSM_Init(&Machine, OrderStates, OrderInit);
+    ThisEvent.EventType = ES_INIT;
+    ThisEvent.EventParam = 0;
+    Passed &= OrderCheck(&Machine, "initial, no ES_EXIT to Init", ThisEvent,
+            "Init:INIT Outer:ENTRY A:ENTRY A1:ENTRY", OrderA1);
+    Passed &= OrderCheck(&Machine, "sibling, A1 to A2", OrderKey(OrderA1, OrderA2),
+            "A1:KEY A1:EXIT A2:ENTRY", OrderA2);
+    Passed &= OrderCheck(&Machine, "child to ancestor, A2 to A", OrderKey(OrderA2, OrderA),
+            "A2:KEY A2:EXIT A:EXIT A:ENTRY A1:ENTRY", OrderA1);
+    Passed &= OrderCheck(&Machine, "self, A1 to A1", OrderKey(OrderA1, OrderA1),
+            "A1:KEY A1:EXIT A1:ENTRY", OrderA1);
+    Passed &= OrderCheck(&Machine, "parent to child, A to A2", OrderKey(OrderA, OrderA2),
+            "A1:KEY A:KEY A1:EXIT A:EXIT A:ENTRY A2:ENTRY", OrderA2);
+    Passed &= OrderCheck(&Machine, "across branches, A2 to B", OrderKey(OrderA2, OrderB),
+            "A2:KEY A2:EXIT A:EXIT B:ENTRY", OrderB);
+    Passed &= OrderCheck(&Machine, "ancestor handles it, Outer to A", OrderKey(OrderOuter, OrderA),
+            "B:KEY Outer:KEY B:EXIT Outer:EXIT Outer:ENTRY A:ENTRY A1:ENTRY", OrderA1);
+
+    printf("%s\r\n", Passed ? "passed" : "FAILED");
+#ifdef __PIC32MX__
+    while (1);
+#else
+    return !Passed;
+#endif
+}
+#endif
+/*------------------------------ End of file ------------------------------*/
+
+
 
 
 
@@ -305,25 +1303,116 @@ void QueueFlushQueue( unsigned char * pBlock )
 #define F_PB F_CPU/2
 #define TIMER_FREQUENCY 1000
 
+#ifdef USE_TICKLESS_TIMERS
+// the core timer counts at SYSCLK/2
+#define CORE_TICKS_PER_MS (F_CPU / 2 / TIMER_FREQUENCY)
+// the longest the core timer is left without an interrupt, well inside the
+// 107s it takes to wrap, so that the elapsed time can always be worked out
+#define TICKLESS_MAX_MS 60000UL
+#endif
+
+#ifdef ES_TIMER_BENCHMARK
+#undef NUM_TIMERS
+#define NUM_TIMERS 255 // the most a uint8_t timer number can name
+#endif
+#ifndef NUM_TIMERS
 #define NUM_TIMERS 16
-#define TranslatePin(x) (1<<x)
+#endif
+#if (NUM_TIMERS < 16) || (NUM_TIMERS > 255)
+#error "NUM_TIMERS must be from 16 to 255, timer numbers are a uint8_t"
+#endif
+// the head of the list of running timers, the entry after the last timer
+#define TIMER_LIST NUM_TIMERS
 /*------------------------------ Module Types -----------------------------*/
 
 
 
 /*---------------------------- Module Functions ---------------------------*/
-
+static void LinkTimer(uint8_t Num, uint32_t Expiry);
+static void UnlinkTimer(uint8_t Num);
+static uint32_t TimeLeft(uint8_t Num);
+static void PostTimerState(uint8_t Num, ES_EventTyp_t State);
+#ifdef USE_TICKLESS_TIMERS
+static uint32_t TimerNow(void);
+static void SetNextCompare(void);
+#endif
 
 /*---------------------------- Module Variables ---------------------------*/
-static unsigned int TMR_TimerArray[NUM_TIMERS];
-
-// make this one const to get it put into flash, since it will never change
-
+// the time a stopped timer has left, 0 once it has timed out
+static uint32_t TMR_TimerArray[NUM_TIMERS];
+
+// the running timers, in the order they will time out, kept as a circular
+// doubly linked list through TIMER_LIST. A timer that is not running links to
+// itself. Each one holds the value of FreeRunningTimer it times out at, so the
+// tick only has to look at the head of the list, however many are running.
+static uint8_t TimerNext[NUM_TIMERS + 1];
+static uint8_t TimerPrev[NUM_TIMERS + 1];
+static uint32_t TimerExpiry[NUM_TIMERS];
+
+#define TimerIsActive(Num) (TimerNext[Num] != (Num))
+
+// whether a timer's timeouts are posted, those of a polled timer are not
+#define TimerPosts(Num) ((Timer2PostFunc[Num] != ES_Timer_NoPost) && \
+                         (Timer2PostFunc[Num] != TIMER_UNUSED))
+
+// the reload of a periodic timer, 0 for a one shot
+static uint32_t TimerPeriod[NUM_TIMERS];
+
+// set when a timer times out, whether or not anything is posted, for the
+// polled timers in timers.c. Cleared by starting it over or by hand
+static volatile uint8_t TimerExpired[NUM_TIMERS];
+
+static uint8_t TimersStarted; // ES_Timer_Init has run
+
+// set the first time a timer is started, so that ES_Timer_GetTimerState can
+// tell a timer that has never run from one that has timed out
+static uint8_t TimerStarted[NUM_TIMERS];
+
+// each arm of a timer gets a new generation, which its ES_TIMEOUTs carry in
+// EventParam above the timer number, with TIMER_GEN_FLAG set to say so. Only
+// the interrupt sets the flag, an ES_TIMEOUT posted by hand has a plain
+// EventParam and is always taken. One that reaches ES_Run after the timer has
+// been armed again or stopped while running is stale and is dropped, see
+// ES_Timer_CheckTimeout. The flag is bit 15 so that it fits a 16 bit
+// EventParam, which leaves 7 bits for the generation.
+#define TIMER_GEN_SHIFT 8
+#define TIMER_GEN_MASK 0x7F
+#define TIMER_GEN_FLAG 0x8000
+static uint8_t TimerGen[NUM_TIMERS];
+static volatile uint16_t StaleTimeouts;
+
+#define NewTimerGen(Num) do { \
+        TimerGen[Num] = (TimerGen[Num] + 1) & TIMER_GEN_MASK; \
+    } while (0)
+
+#ifdef USE_TIMER_STATS
+// how late each timer's timeouts get to a run function, see ES_Timer_Handled
+static ES_TimerStats_t TimerStats[NUM_TIMERS];
+static uint64_t TimerDueStamp[NUM_TIMERS]; // ES_ReadTimestamp at the deadline
+static uint8_t TimerDelivering[NUM_TIMERS]; // timed out, not yet handled
+#define RUN_CLOCK_TICKS_PER_MS (ES_RUN_CLOCK_TICKS_PER_US * 1000UL)
+#endif
 
-static unsigned int TMR_ActiveFlags;
 static uint32_t FreeRunningTimer; /* this is used by the default RTI routine */
 
-static pPostFunc const Timer2PostFunc[NUM_TIMERS] = {TIMER0_RESP_FUNC,
+// ES_ReadTimestamp's upper half, and the last lower half it saw
+static uint32_t StampHigh;
+static uint32_t StampLow;
+
+#ifdef USE_TICKLESS_TIMERS
+// the core timer count at which FreeRunningTimer last ticked over. Between
+// interrupts FreeRunningTimer stands still and the time is worked out from it
+static uint32_t LastMsCount;
+// a time ES_Run asked to be woken at, see ES_Timer_WakeWithin
+static uint32_t WakeTime;
+static uint8_t WakeSet;
+#else
+#define TimerNow() FreeRunningTimer
+#endif
+
+// the first 16 are bound in ES_Configure.h, the rest start out TIMER_UNUSED
+// for ES_Timer_Alloc to hand out
+static pPostFunc Timer2PostFunc[NUM_TIMERS] = {TIMER0_RESP_FUNC,
     TIMER1_RESP_FUNC,
     TIMER2_RESP_FUNC,
     TIMER3_RESP_FUNC,
@@ -349,13 +1438,64 @@ static pPostFunc const Timer2PostFunc[NUM_TIMERS] = {TIMER0_RESP_FUNC,
  * @Function ES_Timer_Init(void)
  * @param none
  * @return None.
- * @brief  Initializes the timer module
+ * @brief  Initializes the timer module. It is called by ES_Initialize and by
+ * TIMERS_Init, and only does anything the first time.
  * @author Max Dunne, 2011.11.15 */
  void ES_Timer_Init(void) {
+    uint16_t i;
+    if (TimersStarted) {
+        return; // the other of ES_Initialize and TIMERS_Init got here first
+    }
+    TimersStarted = TRUE;
+    // every timer starts out stopped, linked to itself, and the list empty
+    for (i = 0; i <= NUM_TIMERS; i++) {
+        TimerNext[i] = i;
+        TimerPrev[i] = i;
+    }
+#ifdef USE_TICKLESS_TIMERS
+    // Timer1 is left alone, the core timer compare interrupts when one is due
+    LastMsCount = _CP0_GET_COUNT();
+    SetNextCompare();
+    mConfigIntCoreTimer(CT_INT_ON | CT_INT_PRIOR_3);
+#else
     OpenTimer1(T1_ON | T1_SOURCE_INT | T1_PS_1_1, F_PB / TIMER_FREQUENCY);
     ConfigIntTimer1(T1_INT_ON | T1_INT_PRIOR_3);
 
     mT1IntEnable(1);
+#endif
+}
+
+/**
+ * @Function ES_Timer_Alloc(pPostFunc PostFunc)
+ * @param PostFunc - the post function for the timer's events
+ * @return the number of a timer that was TIMER_UNUSED, now bound to PostFunc,
+ * or ES_TIMER_NO_HANDLE if there are none left
+ * @brief  hands out a timer at run time, so that a module can have one
+ * without a number of its own in ES_Configure.h. Call it from an init
+ * function, the timers are never given back. */
+uint8_t ES_Timer_Alloc(pPostFunc PostFunc) {
+    uint16_t Num;
+
+    if (PostFunc == TIMER_UNUSED) {
+        return ES_TIMER_NO_HANDLE;
+    }
+    for (Num = 0; Num < NUM_TIMERS; Num++) {
+        if (Timer2PostFunc[Num] == TIMER_UNUSED) {
+            Timer2PostFunc[Num] = PostFunc;
+            return Num;
+        }
+    }
+    return ES_TIMER_NO_HANDLE;
+}
+
+/**
+ * @Function ES_Timer_NoPost(ES_Event ThisEvent)
+ * @param ThisEvent - a timer event
+ * @return TRUE
+ * @brief  the post function for a timer that is only polled, with
+ * ES_Timer_IsTimerExpired. The interrupt posts nothing for such a timer. */
+uint8_t ES_Timer_NoPost(ES_Event ThisEvent) {
+    return TRUE;
 }
 
 /**
@@ -363,15 +1503,22 @@ static pPostFunc const Timer2PostFunc[NUM_TIMERS] = {TIMER0_RESP_FUNC,
  * @param Num - the number of the timer to set.
  * @param NewTime -  the number of milliseconds to be counted
  * @return ERROR or SUCCESS
- * @brief  sets the time for a timer, but does not make it active.
+ * @brief  sets the time for a timer, but does not make it active. A timer
+ * that is already running carries on with the new time.
  * @author Max Dunne  2011.11.15 */
 ES_TimerReturn_t ES_Timer_SetTimer(uint8_t Num, uint32_t NewTime) {
-    static ES_Event NewEvent;
     // tried to set a timer that doesn't exist
     if ((Num >= NUM_TIMERS) || (Timer2PostFunc[Num] == TIMER_UNUSED) || (NewTime == 0)) {
         return ES_Timer_ERR;
     }
+    EnterCritical();
     TMR_TimerArray[Num] = NewTime;
+    if (TimerIsActive(Num)) {
+        NewTimerGen(Num);
+        UnlinkTimer(Num);
+        LinkTimer(Num, TimerNow() + NewTime);
+    }
+    ExitCritical();
     return ES_Timer_OK;
 }
 
@@ -379,19 +1526,22 @@ ES_TimerReturn_t ES_Timer_SetTimer(uint8_t Num, uint32_t NewTime) {
  * @Function ES_Timer_StartTimer(uint8_t Num)
  * @param Num - the number of the timer to start
  * @return ERROR or SUCCESS
- * @brief  simply sets the active flag in TMR_ActiveFlags to resart a stopped timer.
+ * @brief  restarts a stopped timer with the time it had left, a periodic one
+ * then carries on with its period
  * @author Max Dunne, 2011.11.15 */
 ES_TimerReturn_t ES_Timer_StartTimer(uint8_t Num) {
-    static ES_Event NewEvent;
     // tried to set a timer that doesn't exist
     if ((Num >= NUM_TIMERS) || (TMR_TimerArray[Num] == 0)) {
         return ES_Timer_ERR;
     }
-    TMR_ActiveFlags |= TranslatePin(Num); /* set timer as active */
-    NewEvent.EventType = ES_TIMERACTIVE;
-    NewEvent.EventParam = Num;
-    // post the timeout event to the right Service
-    Timer2PostFunc[Num](NewEvent);
+    EnterCritical();
+    if (!TimerIsActive(Num)) {
+        NewTimerGen(Num);
+        TimerStarted[Num] = TRUE;
+        LinkTimer(Num, TimerNow() + TMR_TimerArray[Num]); /* set timer as active */
+    }
+    ExitCritical();
+    PostTimerState(Num, ES_TIMERACTIVE);
     return ES_Timer_OK;
 }
 
@@ -399,19 +1549,31 @@ ES_TimerReturn_t ES_Timer_StartTimer(uint8_t Num) {
  * @Function ES_Timer_StopTimer(unsigned char Num)
  * @param Num - the number of the timer to stop.
  * @return ERROR or SUCCESS
- * @brief  simply clears the bit in TimerActiveFlags associated with this timer. This 
- * will cause it to stop counting.
+ * @brief  takes the timer out of the running list, keeping the time it had
+ * left so that ES_Timer_StartTimer can carry on from there. A timeout it
+ * posted while it was running is dropped before it reaches a run function,
+ * one it had already timed out with is not.
  * @author Max Dunne 2011.11.15 */
 ES_TimerReturn_t ES_Timer_StopTimer(unsigned char Num) {
-    static ES_Event NewEvent;
-    if ((Num >= NUM_TIMERS) || (Timer2PostFunc[Num] == TIMER_UNUSED) || !(TMR_ActiveFlags & TranslatePin(Num))) {
+    uint8_t WasActive = FALSE;
+    if ((Num >= NUM_TIMERS) || (Timer2PostFunc[Num] == TIMER_UNUSED)) {
         return ES_Timer_ERR; // tried to set a timer that doesn't exist
     }
-    TMR_ActiveFlags &= ~(TranslatePin(Num)); // set timer as inactive
-    NewEvent.EventType = ES_TIMERSTOPPED;
-    NewEvent.EventParam = Num;
-    // post the timeout event to the right Service
-    Timer2PostFunc[Num](NewEvent);
+    EnterCritical();
+    if (TimerIsActive(Num)) {
+        WasActive = TRUE;
+        TMR_TimerArray[Num] = TimeLeft(Num);
+        if (TMR_TimerArray[Num] == 0) {
+            TMR_TimerArray[Num] = 1; // due, but its timeout is not posted yet
+        }
+        UnlinkTimer(Num); // set timer as inactive
+        NewTimerGen(Num); // a periodic timeout on its way is stale
+    }
+    ExitCritical();
+    if (!WasActive) {
+        return ES_Timer_ERR;
+    }
+    PostTimerState(Num, ES_TIMERSTOPPED);
     return ES_Timer_OK;
 }
 
@@ -424,75 +1586,849 @@ ES_TimerReturn_t ES_Timer_StopTimer(unsigned char Num) {
  * and sets the timer actice to begin counting.
  * @author Max Dunne 2011.11.15 */
 ES_TimerReturn_t ES_Timer_InitTimer(uint8_t Num, uint32_t NewTime) {
-    static ES_Event NewEvent;
     if ((Num >= NUM_TIMERS) || (Timer2PostFunc[Num] == TIMER_UNUSED) || (NewTime == 0)) {
         return ES_Timer_ERR;
     }
+    EnterCritical();
     TMR_TimerArray[Num] = NewTime;
-    TMR_ActiveFlags |= TranslatePin(Num); /* set timer as active */
-    NewEvent.EventType = ES_TIMERACTIVE;
-    NewEvent.EventParam = Num;
-    // post the timeout event to the right Service
-    Timer2PostFunc[Num](NewEvent);
+    TimerPeriod[Num] = 0; // one shot
+    TimerExpired[Num] = FALSE;
+    TimerStarted[Num] = TRUE;
+    NewTimerGen(Num);
+    if (TimerIsActive(Num)) {
+        UnlinkTimer(Num);
+    }
+    LinkTimer(Num, TimerNow() + NewTime); /* set timer as active */
+    ExitCritical();
+    PostTimerState(Num, ES_TIMERACTIVE);
+    return ES_Timer_OK;
+}
+
+/**
+ * @Function ES_Timer_InitPeriodicTimer(uint8_t Num, uint32_t Period)
+ * @param Num -  the number of the timer to start
+ * @param Period - the number of milliseconds between timeouts
+ * @return ERROR or SUCCESS
+ * @brief  starts the timer timing out every Period milliseconds until it is
+ * stopped or given a one shot time with ES_Timer_InitTimer. Each timeout is
+ * due Period after the last one was due, not after it was handled, so the
+ * time it takes to get to a run function does not add up, a slow run
+ * function only makes the timeouts late. A period that has gone by entirely
+ * before the interrupt got to it is skipped, not posted, which can only
+ * happen with USE_TICKLESS_TIMERS and interrupts held off for over a period. */
+ES_TimerReturn_t ES_Timer_InitPeriodicTimer(uint8_t Num, uint32_t Period) {
+    if ((Num >= NUM_TIMERS) || (Timer2PostFunc[Num] == TIMER_UNUSED) || (Period == 0)) {
+        return ES_Timer_ERR;
+    }
+    EnterCritical();
+    TMR_TimerArray[Num] = Period;
+    TimerPeriod[Num] = Period;
+    TimerExpired[Num] = FALSE;
+    TimerStarted[Num] = TRUE;
+    NewTimerGen(Num);
+    if (TimerIsActive(Num)) {
+        UnlinkTimer(Num);
+    }
+    LinkTimer(Num, TimerNow() + Period); /* set timer as active */
+    ExitCritical();
+    PostTimerState(Num, ES_TIMERACTIVE);
+    return ES_Timer_OK;
+}
+
+/**
+ * @Function ES_Timer_IsTimerActive(uint8_t Num)
+ * @param Num - the number of the timer to check
+ * @return ERROR, ES_Timer_ACTIVE or ES_Timer_NOT_ACTIVE
+ * @brief  whether the timer is counting */
+ES_TimerReturn_t ES_Timer_IsTimerActive(uint8_t Num) {
+    if (Num >= NUM_TIMERS) {
+        return ES_Timer_ERR;
+    }
+    return TimerIsActive(Num) ? ES_Timer_ACTIVE : ES_Timer_NOT_ACTIVE;
+}
+
+/**
+ * @Function ES_Timer_IsTimerExpired(uint8_t Num)
+ * @param Num - the number of the timer to check
+ * @return ERROR, ES_Timer_EXPIRED or ES_Timer_NOT_EXPIRED
+ * @brief  whether the timer has timed out since it was last started with
+ * ES_Timer_InitTimer or cleared with ES_Timer_ClearTimerExpired. For timers
+ * that are polled rather than waited on with ES_TIMEOUT. */
+ES_TimerReturn_t ES_Timer_IsTimerExpired(uint8_t Num) {
+    if (Num >= NUM_TIMERS) {
+        return ES_Timer_ERR;
+    }
+    return TimerExpired[Num] ? ES_Timer_EXPIRED : ES_Timer_NOT_EXPIRED;
+}
+
+/**
+ * @Function ES_Timer_ClearTimerExpired(uint8_t Num)
+ * @param Num - the timer whose expired flag should be cleared
+ * @return ERROR or SUCCESS
+ * @brief  shows that the timeout has been dealt with */
+ES_TimerReturn_t ES_Timer_ClearTimerExpired(uint8_t Num) {
+    if (Num >= NUM_TIMERS) {
+        return ES_Timer_ERR;
+    }
+    TimerExpired[Num] = FALSE;
     return ES_Timer_OK;
 }
 
+/**
+ * @Function ES_Timer_GetTimerState(uint8_t Num)
+ * @param Num - the number of the timer to check
+ * @return ES_TIMERACTIVE while it is counting, ES_TIMEOUT once it has timed
+ * out, ES_TIMERSTOPPED if it was stopped with time left, and ES_NO_EVENT if
+ * it has never been started or is not a timer
+ * @brief  the state a service used to follow from ES_TIMERACTIVE and
+ * ES_TIMERSTOPPED, read straight from the timer */
+ES_EventTyp_t ES_Timer_GetTimerState(uint8_t Num) {
+    ES_EventTyp_t State;
+
+    if (Num >= NUM_TIMERS) {
+        return ES_NO_EVENT;
+    }
+    EnterCritical();
+    if (TimerIsActive(Num)) {
+        State = ES_TIMERACTIVE;
+    } else if (!TimerStarted[Num]) {
+        State = ES_NO_EVENT;
+    } else if (TMR_TimerArray[Num] == 0) {
+        State = ES_TIMEOUT;
+    } else {
+        State = ES_TIMERSTOPPED;
+    }
+    ExitCritical();
+    return State;
+}
+
+/**
+ * @Function ES_Timer_GetTimeLeft(uint8_t Num)
+ * @param Num - the number of the timer to check
+ * @return milliseconds until a running timer times out, or that a stopped
+ * one will count once it is started again, 0 once it has timed out
+ * @brief  works for any timer, unlike ES_Timer_GetTimeToExpiry which gives
+ * the soonest */
+uint32_t ES_Timer_GetTimeLeft(uint8_t Num) {
+    uint32_t Left;
+
+    if (Num >= NUM_TIMERS) {
+        return 0;
+    }
+    EnterCritical();
+    Left = TimerIsActive(Num) ? TimeLeft(Num) : TMR_TimerArray[Num];
+    ExitCritical();
+    return Left;
+}
+
 /**
  * Function: ES_Timer_GetTime(void)
  * @param None
  * @return FreeRunningTimer - the current value of the module variable FreeRunningTimer
  * @remark Provides the ability to grab a snapshot time as an alternative to using
  * the library timers. Can be used to determine how long between 2 events.
+ * With USE_TICKLESS_TIMERS it is worked out from the core timer, so it is
+ * exact even though there is no interrupt every millisecond. For finer times,
+ * or ones that must not wrap, use ES_ReadTimestamp.
  * @author Max Dunne, 2011.11.15  */
 uint32_t ES_Timer_GetTime(void) {
+#ifdef USE_TICKLESS_TIMERS
+    uint32_t Now;
+    EnterCritical();
+    Now = TimerNow();
+    ExitCritical();
+    return Now;
+#else
     return (FreeRunningTimer);
+#endif
 }
 
-/****************************************************************************
- Function
-     ES_Timer_RTI_Resp
- Parameters
-     None.
- Returns
-     None.
- Description
-     This is the new RTI response routine to support the timer module.
-     It will increment time, to maintain the functionality of the
-     GetTime() timer and it will check through the active timers,
-     decrementing each active timers count, if the count goes to 0, it
-     will post an event to the corresponding SM and clear the active flag to
-     prevent further counting.
+/**
+ * Function: ES_ReadTimestamp(void)
+ * @param None
+ * @return the time in ES_RUN_CLOCK_TICKS_PER_US ticks, from the 32 bit
+ * ES_ReadRunClock with the wraps it has gone through counted above it
+ * @remark a wrap is seen as the clock reading less than last time, so it has
+ * to be called at least once per wrap. The timer interrupt calls it every
+ * time, which is at least every TICKLESS_MAX_MS or every millisecond.
+ * Interrupts are held off while it runs so that it can be called from them */
+uint64_t ES_ReadTimestamp(void) {
+    uint32_t Low;
+    uint64_t Stamp;
+
+    EnterCritical();
+    Low = ES_ReadRunClock();
+    if (Low < StampLow) {
+        StampHigh++;
+    }
+    StampLow = Low;
+    Stamp = ((uint64_t) StampHigh << 32) | Low;
+    ExitCritical();
+    return Stamp;
+}
+
+/**
+ * Function: ES_Timer_GetTimeToExpiry(void)
+ * @param None
+ * @return milliseconds until the next active timer times out, ES_NO_DEADLINE
+ * if no timer is running
+ * @remark the soonest timer is always the head of the running list */
+uint32_t ES_Timer_GetTimeToExpiry(void) {
+    uint32_t Soonest = ES_NO_DEADLINE;
+
+    EnterCritical();
+    if (TimerNext[TIMER_LIST] != TIMER_LIST) {
+        Soonest = TimeLeft(TimerNext[TIMER_LIST]);
+    }
+    ExitCritical();
+    return Soonest;
+}
+
+/**
+ * Function: ES_Timer_WakeWithin(uint32_t Ms)
+ * @param Ms - the longest ES_Run may sleep, ES_NO_DEADLINE for no limit
+ * @return None
+ * @remark called by ES_Run just before it waits for an interrupt, so that one
+ * comes when the next event checker is due even if no timer is. Only needed
+ * with USE_TICKLESS_TIMERS, the 1ms tick wakes it otherwise. The wake up
+ * posts nothing and is forgotten once it has gone by */
+void ES_Timer_WakeWithin(uint32_t Ms) {
+#ifdef USE_TICKLESS_TIMERS
+    if ((Ms == ES_NO_DEADLINE) || (Ms == 0)) {
+        return;
+    }
+    EnterCritical();
+    WakeTime = TimerNow() + Ms;
+    WakeSet = TRUE;
+    SetNextCompare();
+    ExitCritical();
+#endif
+}
+
+/**
+ * Function: ES_Timer_Handled(uint8_t Num)
+ * @param Num - the EventParam of an ES_TIMEOUT that is about to be handled
+ * @return None
+ * @remark called by ES_Run as it hands an ES_TIMEOUT to a run function. The
+ * time since the timeout was due goes into the timer's lateness counters.
+ * Only the first run function to get a timeout counts. Does nothing without
+ * USE_TIMER_STATS */
+void ES_Timer_Handled(uint8_t Num) {
+#ifdef USE_TIMER_STATS
+    uint64_t Late;
+    if ((Num >= NUM_TIMERS) || (TimerDelivering[Num] == FALSE)) {
+        return; // not one of ours, or already counted
+    }
+    TimerDelivering[Num] = FALSE;
+    Late = ES_ReadTimestamp() - TimerDueStamp[Num];
+    if (Late > 0xFFFFFFFFULL) {
+        Late = 0xFFFFFFFFULL;
+    }
+    if (Late > TimerStats[Num].WorstLate) {
+        TimerStats[Num].WorstLate = (uint32_t) Late;
+    }
+    TimerStats[Num].Handled++;
+#endif
+}
+
+/**
+ * Function: ES_Timer_CheckTimeout(ES_Event *pThisEvent)
+ * @param pThisEvent - an ES_TIMEOUT just taken from a queue
+ * @return FALSE if it is stale and must be dropped, otherwise TRUE
+ * @remark called by ES_Run before an ES_TIMEOUT gets to a run function. A
+ * timeout from an earlier arm of its timer, one that was restarted or
+ * stopped after the timeout was posted, is stale and counted. Otherwise the
+ * generation is taken off so that EventParam is just the timer number, and
+ * the timeout goes to ES_Timer_Handled. Only timeouts the timer interrupt
+ * posted carry a generation, marked by bit 15 of EventParam, which is
+ * reserved for it. An ES_TIMEOUT posted by hand must leave that bit clear
+ * and is always taken as it is. */
+uint8_t ES_Timer_CheckTimeout(ES_Event *pThisEvent) {
+    uint8_t Num = pThisEvent->EventParam & 0xFF;
+    uint8_t Gen = (pThisEvent->EventParam >> TIMER_GEN_SHIFT) & TIMER_GEN_MASK;
+
+    if ((pThisEvent->EventParam & TIMER_GEN_FLAG) && (Num < NUM_TIMERS)) {
+        if (Gen != TimerGen[Num]) {
+            __sync_fetch_and_add(&StaleTimeouts, 1);
+#ifdef USE_TIMER_STATS
+            TimerStats[Num].Stale++;
+#endif
+            return FALSE;
+        }
+        pThisEvent->EventParam = Num;
+    }
+    ES_Timer_Handled(pThisEvent->EventParam);
+    return TRUE;
+}
+
+/**
+ * Function: ES_Timer_GetStaleTimeouts(void)
+ * @param None
+ * @return the number of ES_TIMEOUTs dropped by ES_Timer_CheckTimeout
+ * @remark with USE_TIMER_STATS each timer's Stale counter has its share */
+uint16_t ES_Timer_GetStaleTimeouts(void) {
+    return StaleTimeouts;
+}
+
+/**
+ * Function: ES_Timer_GetStats(uint8_t Num, ES_TimerStats_t *pStats)
+ * @param Num - the number of the timer
+ * @param pStats - where to put its counters
+ * @return ERROR if there is no such timer, otherwise SUCCESS
+ * @remark the counters are all zero unless USE_TIMER_STATS is defined */
+ES_TimerReturn_t ES_Timer_GetStats(uint8_t Num, ES_TimerStats_t *pStats) {
+    if (Num >= NUM_TIMERS) {
+        return ES_Timer_ERR;
+    }
+#ifdef USE_TIMER_STATS
+    EnterCritical();
+    *pStats = TimerStats[Num];
+    ExitCritical();
+    pStats->WorstLate /= ES_RUN_CLOCK_TICKS_PER_US;
+#else
+    pStats->Timeouts = 0;
+    pStats->Handled = 0;
+    pStats->Skipped = 0;
+    pStats->Stale = 0;
+    pStats->WorstLate = 0;
+#endif
+    pStats->Period = TimerPeriod[Num];
+    return ES_Timer_OK;
+}
+
+/**
+ * Function: ES_Timer_ResetStats(void)
+ * @param None
+ * @return None
+ * @remark zeroes the counters of every timer */
+void ES_Timer_ResetStats(void) {
+#ifdef USE_TIMER_STATS
+    uint16_t Num;
+    EnterCritical();
+    for (Num = 0; Num < NUM_TIMERS; Num++) {
+        TimerStats[Num].Timeouts = 0;
+        TimerStats[Num].Handled = 0;
+        TimerStats[Num].Skipped = 0;
+        TimerStats[Num].Stale = 0;
+        TimerStats[Num].WorstLate = 0;
+    }
+    ExitCritical();
+#endif
+}
+
+/****************************************************************************
+ Function
+     LinkTimer
+ Parameters
+     uint8_t Num : a timer that is not running
+     uint32_t Expiry : the time it times out at, after FreeRunningTimer
+ Returns
+     None.
+ Description
+     puts the timer into the running list, behind every timer that times
+     out sooner, or at the same tick with a lower number, so that timeouts
+     come out in the same order they always have
+ Notes
+     call with interrupts off. The walk is the only part that grows with the
+     number of running timers, and it is done here, once per start, rather
+     than in the tick
+ ****************************************************************************/
+static void LinkTimer(uint8_t Num, uint32_t Expiry) {
+    uint8_t After = TimerNext[TIMER_LIST];
+    uint32_t Wait;
+
+    TimerExpiry[Num] = Expiry;
+    // how far past FreeRunningTimer, rather than the expiry itself, is
+    // compared so that it still works when FreeRunningTimer wraps. Every
+    // running timer is past it, the interrupt takes off any that are not
+    Wait = TimerExpiry[Num] - FreeRunningTimer;
+    while ((After != TIMER_LIST) &&
+            (((TimerExpiry[After] - FreeRunningTimer) < Wait) ||
+            (((TimerExpiry[After] - FreeRunningTimer) == Wait) && (After < Num)))) {
+        After = TimerNext[After];
+    }
+    // goes in just before After
+    TimerNext[Num] = After;
+    TimerPrev[Num] = TimerPrev[After];
+    TimerNext[TimerPrev[After]] = Num;
+    TimerPrev[After] = Num;
+#ifdef USE_TICKLESS_TIMERS
+    if (TimerPrev[Num] == TIMER_LIST) {
+        SetNextCompare(); // it is the new soonest
+    }
+#endif
+}
+
+/****************************************************************************
+ Function
+     UnlinkTimer
+ Parameters
+     uint8_t Num : a running timer
+ Returns
+     None.
+ Description
+     takes the timer out of the running list and links it to itself
+ Notes
+     call with interrupts off
+ ****************************************************************************/
+static void UnlinkTimer(uint8_t Num) {
+    TimerNext[TimerPrev[Num]] = TimerNext[Num];
+    TimerPrev[TimerNext[Num]] = TimerPrev[Num];
+    TimerNext[Num] = Num;
+    TimerPrev[Num] = Num;
+}
+
+/****************************************************************************
+ Function
+     PostTimerState
+ Parameters
+     uint8_t Num : the timer that was started or stopped
+     ES_EventTyp_t State : ES_TIMERACTIVE or ES_TIMERSTOPPED
+ Returns
+     None.
+ Description
+     tells the timer's service that it has been started or stopped
+ Notes
+     with SUPPRESS_TIMER_STATE_EVENTS nothing is posted, the state is there
+     to be read with ES_Timer_GetTimerState instead
+ ****************************************************************************/
+static void PostTimerState(uint8_t Num, ES_EventTyp_t State) {
+#ifndef SUPPRESS_TIMER_STATE_EVENTS
+    ES_Event NewEvent;
+    NewEvent.EventType = State;
+    NewEvent.EventParam = Num;
+    // post the event to the right Service
+    Timer2PostFunc[Num](NewEvent);
+#endif
+}
+
+/****************************************************************************
+ Function
+     TimeLeft
+ Parameters
+     uint8_t Num : a running timer
+ Returns
+     uint32_t : milliseconds until it times out, 0 if it is due
+ Description
+     the time a running timer has left
+ Notes
+     call with interrupts off
+ ****************************************************************************/
+static uint32_t TimeLeft(uint8_t Num) {
+    uint32_t Now = TimerNow();
+    if ((TimerExpiry[Num] - FreeRunningTimer) <= (Now - FreeRunningTimer)) {
+        return 0; // the interrupt has not got to it yet
+    }
+    return TimerExpiry[Num] - Now;
+}
+
+#ifdef USE_TICKLESS_TIMERS
+/****************************************************************************
+ Function
+     TimerNow
+ Parameters
+     None.
+ Returns
+     uint32_t : the time in milliseconds
+ Description
+     FreeRunningTimer plus the whole milliseconds the core timer has counted
+     since it last ticked over
+ Notes
+     call with interrupts off
+ ****************************************************************************/
+static uint32_t TimerNow(void) {
+    return FreeRunningTimer + (_CP0_GET_COUNT() - LastMsCount) / CORE_TICKS_PER_MS;
+}
+
+/****************************************************************************
+ Function
+     SetNextCompare
+ Parameters
+     None.
+ Returns
+     None.
+ Description
+     sets the core timer compare for the millisecond the soonest running
+     timer is due, or ES_Run asked to be woken at, or TICKLESS_MAX_MS from
+     the last tick over if that is sooner or there is neither
  Notes
+     call with interrupts off. The compare only matches on the way past, so
+     if the count is already beyond it the interrupt is raised by hand rather
+     than waiting for the count to wrap round to it
+ ****************************************************************************/
+static void SetNextCompare(void) {
+    uint32_t Wait = TICKLESS_MAX_MS;
+    uint8_t Soonest = TimerNext[TIMER_LIST];
+
+    if ((Soonest != TIMER_LIST) && ((TimerExpiry[Soonest] - FreeRunningTimer) < Wait)) {
+        Wait = TimerExpiry[Soonest] - FreeRunningTimer;
+    }
+    if (WakeSet && ((WakeTime - FreeRunningTimer) < Wait)) {
+        Wait = WakeTime - FreeRunningTimer;
+    }
+    _CP0_SET_COMPARE(LastMsCount + Wait * CORE_TICKS_PER_MS);
+    if ((_CP0_GET_COUNT() - LastMsCount) >= Wait * CORE_TICKS_PER_MS) {
+        mCTSetIntFlag();
+    }
+}
+#endif
+
+/****************************************************************************
+ Function
+     ES_Timer_RTI_Resp
+ Parameters
+     None.
+ Returns
      None.
+ Description
+     This is the new RTI response routine to support the timer module.
+     It will increment time, to maintain the functionality of the
+     GetTime() timer and it will take every timer that times out at the new
+     time off the front of the running list, posting an event to the
+     corresponding SM for each.
+ Notes
+     Only the timers that time out are looked at, so the tick costs the same
+     however many timers are running. A periodic timer goes straight back
+     into the list, due a period after it was due. With USE_TICKLESS_TIMERS
+     it is the core timer interrupt, which only comes when a timer is due,
+     and time moves on by however many milliseconds have gone by since the
+     last one.
  Author
      J. Edward Carryer, 02/24/97 15:06
  ****************************************************************************/
+#ifdef USE_TICKLESS_TIMERS
+void __ISR(_CORE_TIMER_VECTOR, ipl3auto) CoreTimerIntHandler(void) {
+#else
 void __ISR(_TIMER_1_VECTOR, ipl3auto) Timer1IntHandler(void) {
+#endif
     static ES_Event NewEvent;
-    uint8_t CurTimer = 0;
+    uint8_t CurTimer;
+    uint32_t Elapsed, Next;
+#ifdef USE_TIMER_STATS
+    uint64_t Now;
+#endif
+#ifdef USE_TICKLESS_TIMERS
+    mCTClearIntFlag();
+#else
     mT1ClearIntFlag();
-#ifdef USE_KEYBOARD_INPUT
-    return;
-#endif
-    ++FreeRunningTimer; // keep the GetTime() timer running 
-    if (TMR_ActiveFlags != 0) {
-        for (CurTimer = 0; CurTimer < NUM_TIMERS; CurTimer++) {
-            if ((TMR_ActiveFlags & (TranslatePin(CurTimer))) != 0) {
-                if (--TMR_TimerArray[CurTimer] == 0) {
-                    NewEvent.EventType = ES_TIMEOUT;
-                    NewEvent.EventParam = CurTimer;
-                    // post the timeout event to the right Service
-                    Timer2PostFunc[CurTimer](NewEvent);
-                    // and stop counting
-                    TMR_ActiveFlags &= ~(TranslatePin(CurTimer));
-                }
-
+#endif
+#ifdef USE_TIMER_STATS
+    Now = ES_ReadTimestamp();
+#else
+    ES_ReadTimestamp(); // often enough to see the run clock wrap
+#endif
+#ifdef USE_TICKLESS_TIMERS
+    Elapsed = (_CP0_GET_COUNT() - LastMsCount) / CORE_TICKS_PER_MS;
+    LastMsCount += Elapsed * CORE_TICKS_PER_MS;
+#else
+    Elapsed = 1;
+#endif
+    FreeRunningTimer += Elapsed; // keep the GetTime() timer running
+#ifdef USE_TICKLESS_TIMERS
+    if (WakeSet && ((WakeTime - (FreeRunningTimer - Elapsed)) <= Elapsed)) {
+        WakeSet = FALSE; // ES_Run is awake, it asks again before it sleeps
+    }
+#endif
+    CurTimer = TimerNext[TIMER_LIST];
+    // every running timer was due after the old time, so the ones due now
+    // are those no further past it than the time that has gone by
+    while ((CurTimer != TIMER_LIST) &&
+            ((TimerExpiry[CurTimer] - (FreeRunningTimer - Elapsed)) <= Elapsed)) {
+        UnlinkTimer(CurTimer);
+        TimerExpired[CurTimer] = TRUE;
+#ifdef USE_TIMER_STATS
+        TimerStats[CurTimer].Timeouts++;
+        TimerDueStamp[CurTimer] = Now -
+                (uint64_t) (FreeRunningTimer - TimerExpiry[CurTimer]) * RUN_CLOCK_TICKS_PER_MS;
+        TimerDelivering[CurTimer] = TimerPosts(CurTimer);
+#endif
+        if (TimerPeriod[CurTimer] != 0) {
+            // reload from when it was due, not from now
+            Next = TimerExpiry[CurTimer] + TimerPeriod[CurTimer];
+            while ((Next - (FreeRunningTimer - Elapsed)) <= Elapsed) {
+                Next += TimerPeriod[CurTimer];
+#ifdef USE_TIMER_STATS
+                TimerStats[CurTimer].Skipped++;
+#endif
             }
+            LinkTimer(CurTimer, Next);
+        } else {
+            // stop counting
+            TMR_TimerArray[CurTimer] = 0;
         }
-
+#ifndef USE_KEYBOARD_INPUT
+        // with keyboard input the timeouts are typed in instead, time and the
+        // timers carry on but nothing is posted. A polled timer has only its
+        // expired flag, so it takes no room in the ISR post ring
+        if (TimerPosts(CurTimer)) {
+            NewEvent.EventType = ES_TIMEOUT;
+            NewEvent.EventParam = TIMER_GEN_FLAG | CurTimer |
+                    ((ES_EventParam_t) TimerGen[CurTimer] << TIMER_GEN_SHIFT);
+            // post the timeout event to the right Service
+            ES_PostFromISR(Timer2PostFunc[CurTimer], NewEvent);
+        }
+#endif
+        CurTimer = TimerNext[TIMER_LIST];
     }
+#ifdef USE_TICKLESS_TIMERS
+    SetNextCompare();
+#endif
 }
 /*------------------------------- Footnotes -------------------------------*/
+#ifdef ES_TIMER_BENCHMARK
+/* Tick cost benchmark, for a host build with USE_KEYBOARD_INPUT off. It calls
+ * Timer1IntHandler directly with more and more timers running, none of which
+ * time out while it is being timed, and prints the average cost of a tick for
+ * each count. make bench_timers in projects_and_templates/HostTest builds it.
+ * There a tick costs about half a microsecond whatever the count, most of it
+ * the two system calls that stand in for turning interrupts off and on, see
+ * HostTest/host/host_builtins.h. It is the flat cost that matters, not its
+ * size. */
+#include <stdio.h>
+
+#define BENCH_TICKS 100000UL
+
+static const uint8_t BenchRunning[] = {1, 4, 16, 64, 128, NUM_TIMERS};
+static uint8_t BenchTimer[NUM_TIMERS];
+
+static uint8_t IgnoreTimerEvent(ES_Event ThisEvent) {
+    return TRUE;
+}
+
+int main(void) {
+    uint16_t Num, Allocated, Running;
+    uint8_t Count;
+    uint32_t i, Start, Ticks;
+
+    ES_Timer_Init();
+    // every timer ES_Configure.h leaves unused
+    for (Allocated = 0; Allocated < NUM_TIMERS; Allocated++) {
+        BenchTimer[Allocated] = ES_Timer_Alloc(IgnoreTimerEvent);
+        if (BenchTimer[Allocated] == ES_TIMER_NO_HANDLE) {
+            break;
+        }
+    }
+    printf("ES_Timer tick cost benchmark, %lu ticks each\r\n", BENCH_TICKS);
+    for (Count = 0; Count < ARRAY_SIZE(BenchRunning); Count++) {
+        Running = (BenchRunning[Count] < Allocated) ? BenchRunning[Count] : Allocated;
+        for (Num = 0; Num < Running; Num++) {
+            ES_Timer_InitTimer(BenchTimer[Num], 2 * BENCH_TICKS + Num);
+        }
+        Start = ES_ReadRunClock();
+        for (i = 0; i < BENCH_TICKS; i++) {
+#ifdef USE_TICKLESS_TIMERS
+            CoreTimerIntHandler();
+#else
+            Timer1IntHandler();
+#endif
+        }
+        Ticks = ES_ReadRunClock() - Start;
+        printf("%3u timers running: %lu ns per tick\r\n", Running,
+                (unsigned long) (Ticks * 1000ULL / ES_RUN_CLOCK_TICKS_PER_US / BENCH_TICKS));
+    }
+    return 0;
+}
+#endif
+#ifdef ES_TIMER_SKIP_TEST
+/* Skipped period test, for USE_TICKLESS_TIMERS with USE_TIMER_STATS. A
+ * periodic timer runs while the main line, standing in for ES_Run, first
+ * takes SKIP_HOLD_MS over one run function with interrupts on and then holds
+ * interrupts off for as long. The slow run function only makes timeouts late,
+ * the interrupt still reloads on time and nothing is skipped. Held off, the
+ * interrupt sees several periods go by at once, posts the first and skips the
+ * rest. The timeouts are taken with ES_Timer_CheckTimeout as RunService does.
+ * Built for a host, see projects_and_templates/HostTest, the exit status is
+ * the result. */
+#include <stdio.h>
+
+#ifndef USE_TICKLESS_TIMERS
+#error "the skip test needs USE_TICKLESS_TIMERS, a held off 1ms tick loses time rather than skipping"
+#endif
+#ifndef USE_TIMER_STATS
+#error "the skip test reads the timer stats, define USE_TIMER_STATS"
+#endif
+#if defined(USE_ISR_POST_RING) || defined(USE_KEYBOARD_INPUT)
+#error "the skip test takes timeouts straight from the interrupt, undefine USE_ISR_POST_RING and USE_KEYBOARD_INPUT"
+#endif
+
+#define SKIP_PERIOD_MS 4
+#define SKIP_HOLD_MS 15
+#define SKIP_TRIES 3
+
+static ES_Event SkipQueue[ES_QUEUE_BLOCK_SIZE(8)];
+
+static uint8_t SkipTestPost(ES_Event ThisEvent) {
+    return ES_EnQueueFIFO(SkipQueue, ThisEvent);
+}
+
+static void SkipSpin(uint32_t Ms) {
+    uint32_t Start = ES_ReadRunClock();
+    while ((ES_ReadRunClock() - Start) < Ms * 1000UL * ES_RUN_CLOCK_TICKS_PER_US) {
+        ;
+    }
+}
+
+// takes every timeout waiting, as ES_Run would, and returns how many
+static uint8_t SkipTake(void) {
+    ES_Event ThisEvent;
+    uint8_t Taken = 0;
+
+    while (!ES_IsQueueEmpty(SkipQueue)) {
+        ES_DeQueue(SkipQueue, &ThisEvent);
+        if (ES_Timer_CheckTimeout(&ThisEvent) == TRUE) {
+            Taken++;
+        }
+    }
+    return Taken;
+}
+
+// a slow run function, interrupts on, only makes the timeouts late
+static uint8_t SkipSlowRun(uint8_t Num) {
+    ES_TimerStats_t Stats;
+    uint8_t Taken;
+
+    while (ES_IsQueueEmpty(SkipQueue));
+    SkipTake();
+    ES_Timer_ResetStats();
+    SkipSpin(SKIP_HOLD_MS);
+    Taken = SkipTake();
+    if (ES_Timer_GetStats(Num, &Stats) != ES_Timer_OK) {
+        return FALSE;
+    }
+    printf("slow run function: %u timeouts, %lu skipped\r\n", Taken,
+            (unsigned long) Stats.Skipped);
+    return (Taken >= SKIP_HOLD_MS / SKIP_PERIOD_MS) && (Stats.Skipped == 0);
+}
+
+// the interrupt held off comes late, posts one timeout and skips the rest
+static uint8_t SkipHeldOff(uint8_t Num) {
+    ES_TimerStats_t Stats;
+    uint8_t Taken;
+
+    while (ES_IsQueueEmpty(SkipQueue));
+    SkipTake();
+    ES_Timer_ResetStats();
+    EnterCritical();
+    SkipSpin(SKIP_HOLD_MS);
+    ExitCritical(); // the interrupt comes here
+    Taken = SkipTake();
+    if (ES_Timer_GetStats(Num, &Stats) != ES_Timer_OK) {
+        return FALSE;
+    }
+    printf("held off interrupt: %u timeouts, %lu skipped, %lu handled, %lu us late\r\n",
+            Taken, (unsigned long) Stats.Skipped, (unsigned long) Stats.Handled,
+            (unsigned long) Stats.WorstLate);
+    return (Taken == 1) && (Stats.Timeouts == 1) && (Stats.Handled == 1) &&
+            (Stats.Skipped >= SKIP_HOLD_MS / SKIP_PERIOD_MS - 1) &&
+            (Stats.Skipped <= SKIP_HOLD_MS / SKIP_PERIOD_MS) &&
+            (Stats.WorstLate >= (SKIP_HOLD_MS - SKIP_PERIOD_MS - 1) * 1000UL);
+}
+
+int main(void) {
+    uint8_t Num, Try;
+    uint8_t Passed = FALSE;
+
+    BOARD_Init();
+    ES_InitQueue(SkipQueue, ARRAY_SIZE(SkipQueue));
+    ES_Timer_Init();
+    Num = ES_Timer_Alloc(SkipTestPost);
+    printf("Skipped period test, %d ms period, %d ms holds\r\n", SKIP_PERIOD_MS, SKIP_HOLD_MS);
+    ES_Timer_InitPeriodicTimer(Num, SKIP_PERIOD_MS);
+    // a busy host can hold the interrupt off by itself, so a try that goes
+    // wrong is given another go
+    for (Try = 0; (Try < SKIP_TRIES) && !Passed; Try++) {
+        Passed = SkipSlowRun(Num) && SkipHeldOff(Num);
+    }
+    ES_Timer_StopTimer(Num);
+    printf("%s\r\n", Passed ? "passed" : "FAILED");
+    return !Passed;
+}
+#endif
+#ifdef ES_TIMER_STALE_TEST
+/* Stale timeout test, for the 1ms tick. The tick is called by hand, so that
+ * a timeout is always sitting in a queue when its timer is armed again or
+ * stopped. ES_Timer_CheckTimeout, as RunService calls it, must then drop it
+ * and count it, while a timeout from the timer's current arm and ES_TIMEOUTs
+ * posted by hand, with bit 15 of EventParam clear, get through unchanged.
+ * Built for a host, see projects_and_templates/HostTest, the exit status is
+ * the result. */
+#include <stdio.h>
+
+#ifdef USE_TICKLESS_TIMERS
+#error "the stale test ticks the timers by hand, undefine USE_TICKLESS_TIMERS"
+#endif
+#if defined(USE_ISR_POST_RING) || defined(USE_KEYBOARD_INPUT)
+#error "the stale test takes timeouts straight from the interrupt, undefine USE_ISR_POST_RING and USE_KEYBOARD_INPUT"
+#endif
+
+static ES_Event StaleQueue[ES_QUEUE_BLOCK_SIZE(4)];
+
+static uint8_t StaleTestPost(ES_Event ThisEvent) {
+    return ES_EnQueueFIFO(StaleQueue, ThisEvent);
+}
+
+static void StaleTicks(uint8_t Ticks) {
+    while (Ticks-- != 0) {
+        Timer1IntHandler();
+    }
+}
+
+// takes the one event waiting and checks what ES_Timer_CheckTimeout makes of
+// it, and that the stale count went up only if it was dropped
+static uint8_t StaleCheck(const char *pCase, uint8_t Taken, ES_EventParam_t Param) {
+    ES_Event ThisEvent;
+    uint16_t Stale = ES_Timer_GetStaleTimeouts();
+    uint8_t Passed;
+
+    if (ES_DeQueue(StaleQueue, &ThisEvent) != 0) {
+        printf("%s: more than one event queued\r\n", pCase);
+        return FALSE;
+    }
+    Passed = (ThisEvent.EventType == ES_TIMEOUT) &&
+            (ES_Timer_CheckTimeout(&ThisEvent) == Taken) &&
+            (ES_Timer_GetStaleTimeouts() == Stale + !Taken) &&
+            (!Taken || (ThisEvent.EventParam == Param));
+    printf("%s: %s\r\n", pCase, Passed ? (Taken ? "taken" : "dropped") : "FAILED");
+    return Passed;
+}
+
+int main(void) {
+    ES_Event ThisEvent;
+    uint8_t Num;
+    uint8_t Passed = TRUE;
+
+    BOARD_Init();
+    ES_InitQueue(StaleQueue, ARRAY_SIZE(StaleQueue));
+    ES_Timer_Init();
+    Num = ES_Timer_Alloc(StaleTestPost);
+    printf("Stale timeout test, timer %u\r\n", Num);
+
+    ES_Timer_InitTimer(Num, 2);
+    StaleTicks(2);
+    Passed &= StaleCheck("timeout from the current arm", TRUE, Num);
+
+    ES_Timer_InitTimer(Num, 2);
+    StaleTicks(2);
+    ES_Timer_InitTimer(Num, 5);
+    Passed &= StaleCheck("timer armed again", FALSE, 0);
+
+    ES_Timer_InitPeriodicTimer(Num, 2);
+    StaleTicks(2);
+    ES_Timer_StopTimer(Num); // still running, a periodic timer
+    Passed &= StaleCheck("periodic timer stopped", FALSE, 0);
+
+    ThisEvent.EventType = ES_TIMEOUT;
+    ThisEvent.EventParam = 300;
+    StaleTestPost(ThisEvent);
+    Passed &= StaleCheck("posted by hand, param 300", TRUE, 300);
+    ThisEvent.EventParam = Num;
+    StaleTestPost(ThisEvent);
+    Passed &= StaleCheck("posted by hand, the timer's number", TRUE, Num);
+
+    printf("%s\r\n", Passed ? "passed" : "FAILED");
+    return !Passed;
+}
+#endif
 #ifdef TEST
 
 #include <termio.h>
@@ -673,11 +2609,20 @@ uint8_t ES_PostList07( ES_Event NewEvent) {
 ****************************************************************************/
 static uint8_t PostToList( PostFunc_t *const*List, unsigned char ListSize, ES_Event NewEvent){
   unsigned char i;
+#if NUM_PAYLOAD_POOLS > 0
+  // hold the payload so that it outlives the first recipients to run
+  if ( ES_IsPayloadEvent(NewEvent) )
+    ES_PayloadRetain(NewEvent.EventParam);
+#endif
   // loop through the list executing the post functions
   for ( i=0; i< ListSize; i++) {
     if ( List[i](NewEvent) != TRUE )
       break; // this is a failed post
   }
+#if NUM_PAYLOAD_POOLS > 0
+  if ( ES_IsPayloadEvent(NewEvent) )
+    ES_PayloadRelease(NewEvent.EventParam);
+#endif
   if ( i != ListSize ) // if no failures, i = ListSize
     return (FALSE);
   else
@@ -714,6 +2659,17 @@ static uint8_t PostToList( PostFunc_t *const*List, unsigned char ListSize, ES_Ev
 
 #include "serial.h"
 
+#ifdef USE_PREEMPTION
+#include <xc.h>
+#include <peripheral/int.h>
+#endif
+
+#if defined(USE_IDLE_WAIT) && !defined(__PIC32MX__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
 
 /*----------------------------- Module Defines ----------------------------*/
 typedef uint8_t InitFunc_t(uint8_t Priority);
@@ -724,131 +2680,264 @@ typedef RunFunc_t * pRunFunc;
 
 #define NULL_INIT_FUNC ((pInitFunc)0)
 
+// number of the most significant set bit in a non-zero Ready word, a single
+// CLZ instruction on the PIC32
+#define ES_HighestReady(ReadyWord) ((uint8_t) (31 - __builtin_clz(ReadyWord)))
+
 typedef struct {
     InitFunc_t *InitFunc; // Service Initialization function
     RunFunc_t *RunFunc; // Service Run function
+    uint8_t Batch; // events it may take in a row
+    uint32_t BudgetTicks; // longest a call should take, 0 for no limit
 } ES_ServDesc_t;
 
+typedef struct {
+    uint32_t WorstTicks; // longest call so far
+    uint32_t Overruns; // calls longer than the budget
+    uint32_t Runs; // calls timed
+} ES_RunTimes_t;
+
 typedef struct {
     ES_Event *pMem; // pointer to the memory
     uint8_t Size; // how big is it
+    uint8_t Capacity; // how many entries it holds
+    volatile uint8_t Peak; // most entries ever held at once
+    volatile uint16_t Dropped; // posts refused because it was full
+    volatile uint16_t Coalesced; // posts merged into a waiting event
+    volatile uint32_t Posted; // posts accepted
+#if NUM_COALESCED_EVENTS > 0
+    volatile uint32_t Pending; // bit n set if coalesced event n may be waiting
+    uint8_t PendingEntry[NUM_COALESCED_EVENTS]; // and its entry number
+#endif
 } ES_QueueDesc_t;
 
 /*---------------------------- Module Functions ---------------------------*/
 static uint8_t CheckSystemEvents(void);
+static uint8_t PostToQueue(uint8_t WhichService, ES_Event ThisEvent);
+static uint8_t AddToQueue(uint8_t WhichService, ES_Event ThisEvent);
+static uint8_t PostMulticast(uint32_t Targets, ES_Event ThisEvent);
+static void UpdatePeak(ES_QueueDesc_t *pDesc);
+#ifdef USE_RUN_BUDGETS
+static void CheckRunTime(uint8_t WhichService, uint32_t Ticks);
+#endif
+#ifdef USE_IDLE_WAIT
+static void IdleUntilEvent(void);
+static void WakeIdle(void);
+#endif
+static uint8_t RunService(uint8_t WhichService, RunFunc_t *RunFunc,
+        ES_Event ThisEvent, uint8_t Entry);
+#ifdef USE_PREEMPTION
+static void Schedule(void);
+#endif
+#ifdef USE_ISR_POST_RING
+static void DrainIsrPosts(void);
+#endif
+#if NUM_COALESCED_EVENTS > 0
+static uint8_t PostCoalesced(uint8_t WhichService, ES_Event ThisEvent);
+#endif
 
 /*---------------------------- Module Variables ---------------------------*/
 /****************************************************************************/
-// You fill in this array with the names of the service init & run functions
-// for each service that you use.
-// The order is: InitFunction, RunFunction
+// This array is built from SERVICE_LIST in ES_Configure.h, with the names of
+// the service init & run functions for each service that you use.
+// The order is: InitFunction, RunFunction, Batch, Budget
 // The first enry, at index 0, is the lowest priority, with increasing 
 // priority with higher indices
 
+#define SERVICE_DESC_FORM(INIT, RUN, POST, QUEUE_SIZE, BATCH, BUDGET) {INIT, RUN, BATCH, (BUDGET) * ES_RUN_CLOCK_TICKS_PER_US},
 static ES_ServDesc_t const ServDescList[] = {
-    {SERV_0_INIT, SERV_0_RUN} /* lowest priority  always present */
-#if NUM_SERVICES > 1
-    ,
-    {SERV_1_INIT, SERV_1_RUN}
-#endif
-#if NUM_SERVICES > 2
-    ,
-    {SERV_2_INIT, SERV_2_RUN}
-#endif
-#if NUM_SERVICES > 3
-    ,
-    {SERV_3_INIT, SERV_3_RUN}
-#endif
-#if NUM_SERVICES > 4
-    ,
-    {SERV_4_INIT, SERV_4_RUN}
-#endif
-#if NUM_SERVICES > 5
-    ,
-    {SERV_5_INIT, SERV_5_RUN}
-#endif
-#if NUM_SERVICES > 6
-    ,
-    {SERV_6_INIT, SERV_6_RUN}
-#endif
-#if NUM_SERVICES > 7
-    ,
-    {SERV_7_INIT, SERV_7_RUN}
-#endif
-
+    SERVICE_LIST(SERVICE_DESC_FORM)
 };
 
+// every service must take at least one event per turn
+#define SERVICE_BATCH_CHECK_FORM(INIT, RUN, POST, QUEUE_SIZE, BATCH, BUDGET) \
+    typedef char RUN##_BatchInRange[((BATCH) >= 1) && ((BATCH) <= 255) ? 1 : -1];
+SERVICE_LIST(SERVICE_BATCH_CHECK_FORM)
+
 /****************************************************************************/
 // Initialize this variable with the name of the posting function that you
 // want executed when a new keystroke is detected.
 
 static pPostFunc const pPostKeyFunc = POST_KEY_FUNC;
 
+#if NUM_COALESCED_EVENTS > 0
 /****************************************************************************/
-// The queues for the services
+// Each event in COALESCED_EVENTS gets a bit in the queues' pending masks.
+// CoalesceBit maps an event type to its bit number plus one, 0 for events
+// that are queued normally.
 
-static ES_Event Queue0[SERV_0_QUEUE_SIZE + 1];
-#if NUM_SERVICES > 1
-static ES_Event Queue1[SERV_1_QUEUE_SIZE + 1];
-#endif
-#if NUM_SERVICES > 2
-static ES_Event Queue2[SERV_2_QUEUE_SIZE + 1];
-#endif
-#if NUM_SERVICES > 3
-static ES_Event Queue3[SERV_3_QUEUE_SIZE + 1];
-#endif
-#if NUM_SERVICES > 4
-static ES_Event Queue4[SERV_4_QUEUE_SIZE + 1];
+#define COALESCED_ENUM_FORM(EVENT) COALESCED_##EVENT,
+enum {
+    COALESCED_EVENTS(COALESCED_ENUM_FORM)
+};
+
+#define COALESCED_BIT_FORM(EVENT) [EVENT] = COALESCED_##EVENT + 1,
+static uint8_t const CoalesceBit[NUMBEROFEVENTS] = {
+    COALESCED_EVENTS(COALESCED_BIT_FORM)
+};
 #endif
-#if NUM_SERVICES > 5
-static ES_Event Queue5[SERV_5_QUEUE_SIZE + 1];
-#endif
-#if NUM_SERVICES > 6
-static ES_Event Queue6[SERV_6_QUEUE_SIZE + 1];
-#endif
-#if NUM_SERVICES > 7
-static ES_Event Queue7[SERV_7_QUEUE_SIZE + 1];
+
+/****************************************************************************/
+// The queues for the services, all carved out of one block. Each service
+// gets SERVICE_LIST's QueueSize entries, rounded up to a power of two, plus
+// one for the queue header.
+
+#define SERVICE_QUEUE_MEM_FORM(INIT, RUN, POST, QUEUE_SIZE, BATCH, BUDGET) + ES_QUEUE_BLOCK_SIZE(QUEUE_SIZE)
+#define SERVICE_QUEUE_SIZE_FORM(INIT, RUN, POST, QUEUE_SIZE, BATCH, BUDGET) ES_QUEUE_BLOCK_SIZE(QUEUE_SIZE),
+
+static ES_Event QueueMem[0 SERVICE_LIST(SERVICE_QUEUE_MEM_FORM)];
+static uint8_t const QueueBlockSizes[NUM_SERVICES] = {
+    SERVICE_LIST(SERVICE_QUEUE_SIZE_FORM)
+};
+
+/****************************************************************************/
+// array of queue descriptors for posting by priority level, filled in from
+// QueueMem and QueueBlockSizes by ES_Initialize
+
+static ES_QueueDesc_t EventQueues[NUM_SERVICES];
+
+#ifdef USE_RUN_BUDGETS
+/****************************************************************************/
+// how long each service's run function has taken, only touched by ES_Run
+
+static ES_RunTimes_t RunTimes[NUM_SERVICES];
 #endif
 
 /****************************************************************************/
-// array of queue descriptors for posting by priority level
+// Variable used to keep track of which queues have events in them
+// bit n set means the queue for service n is non-empty
+// it is set from interrupts, so bits are only ever changed with the atomic
+// ES_SetReady and ES_ClearReady, never a plain read-modify-write
 
-static ES_QueueDesc_t const EventQueues[NUM_SERVICES] = {
-    { Queue0, ARRAY_SIZE(Queue0)}
-#if NUM_SERVICES > 1
-    ,
-    { Queue1, ARRAY_SIZE(Queue1)}
+volatile uint32_t Ready;
+
+#define ES_ClearReady(Mask) __sync_fetch_and_and(&Ready, ~(Mask))
+
+#ifdef USE_IDLE_WAIT
+/****************************************************************************/
+// set while ES_Run waits for an interrupt, cleared by the post that ends the
+// wait, which also notes the time for the wake up latency counters
+
+static volatile uint8_t Idling;
+static volatile uint32_t WakeStamp;
+static ES_IdleStats_t IdleStats;
+static uint64_t TotalWake;
+
+#ifdef __PIC32MX__
+// any interrupt ends it, the timers make sure one comes by TimeoutMs
+#define ES_IdleWait(TimeoutMs) do { \
+        ES_Timer_WakeWithin(TimeoutMs); \
+        _wait(); \
+    } while (0)
+#else
+// sleeps until a post changes Ready, a signal arrives or the time is up
+static void ES_IdleWait(uint32_t TimeoutMs) {
+    struct timespec Timeout;
+    Timeout.tv_sec = TimeoutMs / 1000;
+    Timeout.tv_nsec = (TimeoutMs % 1000) * 1000000L;
+    syscall(SYS_futex, &Ready, FUTEX_WAIT_PRIVATE, 0,
+            (TimeoutMs == ES_NO_DEADLINE) ? NULL : &Timeout, NULL, 0);
+}
 #endif
-#if NUM_SERVICES > 2
-    ,
-    { Queue2, ARRAY_SIZE(Queue2)}
 #endif
-#if NUM_SERVICES > 3
-    ,
-    { Queue3, ARRAY_SIZE(Queue3)}
+
+#ifdef USE_PREEMPTION
+/****************************************************************************/
+// the priority of the run function executing now, NO_ACTIVE_PRIOR when none
+// is. A post to a service above it requests core software interrupt 0, which
+// runs the scheduler nested on top of it. It starts out at the top service
+// so that posts made by the init functions wait for ES_Run.
+
+#define NO_ACTIVE_PRIOR (-1)
+static volatile int8_t ActivePrior = NUM_SERVICES - 1;
+static volatile uint8_t RunFailed; // a run function returned ES_ERROR
+
+// the Ready bits of the services above Prior
+#define ES_ReadyAbove(Prior) (((Prior) < 0) ? 0xFFFFFFFFUL : \
+                              ~(((uint32_t) 2 << (Prior)) - 1))
+
+#define ES_RequestSchedule() _CP0_BIS_CAUSE(_CP0_CAUSE_IP0_MASK)
 #endif
-#if NUM_SERVICES > 4
-    ,
-    { Queue4, ARRAY_SIZE(Queue4)}
+
+/****************************************************************************/
+// marks services' queues as non-empty. Bits are only ever set this way or
+// cleared with ES_ClearReady, never with a plain read-modify-write. A post
+// that finds ES_Run idle wakes it, see IdleUntilEvent, and one to a service
+// above the active run function preempts it, see Schedule.
+
+static inline void ES_SetReady(uint32_t Mask) {
+    __sync_fetch_and_or(&Ready, Mask);
+#ifdef USE_IDLE_WAIT
+    if (Idling) {
+        WakeIdle();
+    }
 #endif
-#if NUM_SERVICES > 5
-    ,
-    { Queue5, ARRAY_SIZE(Queue5)}
+#ifdef USE_PREEMPTION
+    if ((Mask & ES_ReadyAbove(ActivePrior)) != 0) {
+        ES_RequestSchedule();
+    }
 #endif
-#if NUM_SERVICES > 6
-    ,
-    { Queue6, ARRAY_SIZE(Queue6)}
+}
+
+// the Ready bits of every service, the targets of ES_PostAll
+#define ALL_SERVICES ((uint32_t) (((uint64_t) 1 << NUM_SERVICES) - 1))
+
+// multicasts that were refused because a target queue was full
+static volatile uint16_t MulticastFailures;
+
+#ifdef USE_ISR_POST_RING
+/****************************************************************************/
+// Posts made by interrupts through ES_PostFromISR wait here, with the post
+// function that is to take them, until ES_Run calls it, see DrainIsrPosts.
+// The ring works like an ES_Queue added to with ES_EnQueueFIFOMulti: free
+// running counts, a slot claimed by moving Reserve with a compare and swap
+// and published by moving Head. Only the thread side moves Tail.
+
+#ifndef ISR_POST_RING_SIZE
+#define ISR_POST_RING_SIZE 32
 #endif
-#if NUM_SERVICES > 7
-    ,
-    { Queue7, ARRAY_SIZE(Queue7)}
+typedef char IsrPostRingSizeInRange[((ISR_POST_RING_SIZE & (ISR_POST_RING_SIZE - 1)) == 0) &&
+        (ISR_POST_RING_SIZE <= 128) ? 1 : -1]; // a power of two, for the mask
+
+typedef struct {
+    pPostFunc PostFunc;
+    ES_Event Event;
+} ES_IsrPost_t;
+
+static ES_IsrPost_t IsrPostRing[ISR_POST_RING_SIZE];
+static volatile uint8_t IsrPostHead, IsrPostTail, IsrPostReserve;
+static volatile uint8_t IsrPostDraining; // DrainIsrPosts is running
+static volatile uint16_t IsrPostsDropped; // refused because the ring was full
+
+#define IsrPostsWaiting() (IsrPostHead != IsrPostTail)
+#else
+#define IsrPostsWaiting() FALSE
+#define DrainIsrPosts()
 #endif
-};
 
 /****************************************************************************/
-// Variable used to keep track of which queues have events in them
+// The routing table for ES_Publish, bit n of Subscribers[EventType] set
+// means service n gets events of that type. It starts out from SUBSCRIPTIONS
+// in ES_Configure.h and bits are changed atomically, like Ready.
 
-uint8_t Ready;
+static volatile uint32_t Subscribers[NUMBEROFEVENTS];
+
+#if NUM_SUBSCRIPTIONS > 0
+typedef struct {
+    uint16_t EventType;
+    pPostFunc PostFunc; // names the service, matched against ServPostList
+} ES_Subscription_t;
+
+#define SUBSCRIPTION_FORM(EVENT, POST) {EVENT, POST},
+static ES_Subscription_t const DefaultSubscriptions[] = {
+    SUBSCRIPTIONS(SUBSCRIPTION_FORM)
+};
+
+#define SERVICE_POST_FORM(INIT, RUN, POST, QUEUE_SIZE, BATCH, BUDGET) POST,
+static pPostFunc const ServPostList[] = {
+    SERVICE_LIST(SERVICE_POST_FORM)
+};
+#endif
 
 /*------------------------------ Module Code ------------------------------*/
 
@@ -869,14 +2958,43 @@ uint8_t Ready;
  ****************************************************************************/
 ES_Return_t ES_Initialize(void) {
     unsigned char i;
+    ES_Event *pNextQueue = QueueMem;
     ES_Timer_Init(); // start up the timer subsystem
+#if NUM_PAYLOAD_POOLS > 0
+    ES_InitPayloads();
+#endif
+#if NUM_SUBSCRIPTIONS > 0
+    // set up the routing table before any service can publish
+    for (i = 0; i < ARRAY_SIZE(DefaultSubscriptions); i++) {
+        unsigned char j;
+        for (j = 0; j < ARRAY_SIZE(ServPostList); j++) {
+            if (ServPostList[j] == DefaultSubscriptions[i].PostFunc) {
+                Subscribers[DefaultSubscriptions[i].EventType] |= (uint32_t) 1 << j;
+                break;
+            }
+        }
+        if (j == ARRAY_SIZE(ServPostList))
+            return FailedPointer; // not the post function of any service
+    }
+#endif
+#ifdef USE_PREEMPTION
+    // the software interrupt that runs preempting services, below every
+    // other interrupt so that it runs once they are done
+    INTSetVectorPriority(INT_CORE_SOFTWARE_0_VECTOR, INT_PRIORITY_LEVEL_1);
+    INTClearFlag(INT_CS0);
+    INTEnable(INT_CS0, INT_ENABLED);
+#endif
     // loop through the list testing for NULL pointers and
     for (i = 0; i < ARRAY_SIZE(ServDescList); i++) {
         if ((ServDescList[i].InitFunc == (pInitFunc) 0) ||
                 (ServDescList[i].RunFunc == (pRunFunc) 0))
             return FailedPointer; // protect against NULL pointers
         // and initializing the event queues (must happen before running inits)
-        ES_InitQueue(EventQueues[i].pMem, EventQueues[i].Size);
+        EventQueues[i].pMem = pNextQueue;
+        EventQueues[i].Size = QueueBlockSizes[i];
+        pNextQueue += QueueBlockSizes[i];
+        EventQueues[i].Capacity = ES_InitQueue(EventQueues[i].pMem,
+                EventQueues[i].Size);
         // executing the init functions
         if (ServDescList[i].InitFunc(i) != TRUE)
             return FailedInit; // this is a failed initialization
@@ -889,122 +3007,1003 @@ ES_Return_t ES_Initialize(void) {
    ES_Run
  Parameters
    None
- *
+ *
+ Returns
+   ES_Return_t : FailedRun is any of the run functions failed during execution
+ Description
+   This is the main framework function. It finds the highest priority
+   state machine with a non-empty queue and then executes the
+   state machine to process one event from its queue.
+   while all the queues are empty, it searches for system generated or
+   user generated events.
+ Notes
+   this function only returns in case of an error
+   the highest priority is found with a single count leading zeros on
+   Ready rather than a scan of every service. The service then takes up to
+   its SERVICE_LIST Batch of events in a row, without finding it again for
+   each one, so a burst (timer housekeeping, keystrokes) costs one lookup.
+   The batch ends as soon as a higher priority service is ready, so that
+   service still waits for no more than the one run function that is
+   already executing.
+   with USE_ISR_POST_RING the posts interrupts have left in the ring are
+   handed to their services before each pick, and a batch ends early when
+   more come in. With USE_RUN_BUDGETS each call to a run function is timed,
+   see ES_GetRunStats. With USE_IDLE_WAIT it sleeps, rather than spins, while
+   there is nothing to do, see IdleUntilEvent. With USE_PREEMPTION the
+   services are run by Schedule instead, one event at a time, and Batch is
+   not used.
+ Author
+   J. Edward Carryer, 10/23/11,
+   M. Dunne, 2013.09.18
+ ****************************************************************************/
+ES_Return_t ES_Run(void) {
+#ifndef USE_PREEMPTION
+    // make these static to improve speed
+    uint8_t HighestPrior;
+    uint8_t BatchLeft, Left, Entry;
+    uint32_t ThisBit, HigherBits;
+    ES_Event *pQueue;
+    RunFunc_t *RunFunc;
+    static ES_Event ThisEvent;
+#else
+    EnterCritical();
+    ActivePrior = NO_ACTIVE_PRIOR; // from here on posts can preempt
+    ExitCritical();
+#endif
+
+    while (1) { // stay here unless we detect an error condition
+
+#ifdef USE_PREEMPTION
+        // everything that is ready runs from here or, if it is posted while
+        // a run function is active, from the software interrupt
+        Schedule();
+        if (RunFailed) {
+            return FailedRun;
+        }
+#else
+        // dispatch a batch of events from the highest priority non-empty
+        // queue, then go back and look at Ready again so that anything posted
+        // by those run functions (or by an interrupt) at a higher priority
+        // goes next
+        DrainIsrPosts();
+        while (Ready != 0) {
+            HighestPrior = ES_HighestReady(Ready);
+            pQueue = EventQueues[HighestPrior].pMem;
+            RunFunc = ServDescList[HighestPrior].RunFunc;
+            BatchLeft = ServDescList[HighestPrior].Batch;
+            ThisBit = (uint32_t) 1 << HighestPrior;
+            HigherBits = ~((ThisBit << 1) - 1);
+            do {
+                Entry = ES_QueueNextOut(pQueue);
+                Left = ES_DeQueue(pQueue, &ThisEvent);
+                if (Left == 0) {
+                    ES_ClearReady(ThisBit); // mark queue as now empty
+                    // unless an interrupt posted between the dequeue and the clear
+                    if (!ES_IsQueueEmpty(pQueue)) {
+                        ES_SetReady(ThisBit);
+                    }
+                }
+                if (RunService(HighestPrior, RunFunc, ThisEvent, Entry) != TRUE) {
+                    return FailedRun;
+                }
+            } while ((--BatchLeft != 0) && (Left != 0) &&
+                    ((Ready & HigherBits) == 0) && !IsrPostsWaiting());
+            DrainIsrPosts(); // before the next pick, they may be for a higher one
+        }
+#endif
+        // all the queues are empty, so look for new system or user detected events
+        if (CheckSystemEvents() == TRUE)
+            continue;
+#ifndef USE_KEYBOARD_INPUT
+        if (ES_CheckUserEvents() == TRUE)
+            continue;
+#endif
+#ifdef USE_IDLE_WAIT
+        // nothing to do until an interrupt posts or a checker is due
+        IdleUntilEvent();
+#endif
+
+    }
+}
+
+/****************************************************************************
+ Function
+   ES_PostAll
+ Parameters
+   ES_Event : The Event to be posted
+ Returns
+   uint8_t : FALSE if any of the services' queues was full
+ Description
+   posts to all of the services' queues 
+ Notes
+   all or nothing, if any queue is full no service gets the event
+
+ Author
+   J. Edward Carryer, 01/15/12,
+ ****************************************************************************/
+uint8_t ES_PostAll(ES_Event ThisEvent) {
+    return PostMulticast(ALL_SERVICES, ThisEvent);
+}
+
+/****************************************************************************
+ Function
+   ES_PostToService
+ Parameters
+   uint8_t : Which service to post to (index into ServDescList)
+   ES_Event : The Event to be posted
+ Returns
+   uint8_t : FALSE if the post function failed during execution
+ Description
+   posts to one of the services' queues
+ Notes
+   used by the timer library to associate a timer with a state machine
+   safe to call from the main line and from any number of interrupts, the
+   queues are multiple producer and never need interrupts turned off
+ Author
+   J. Edward Carryer, 01/16/12,
+ ****************************************************************************/
+uint8_t ES_PostToService(uint8_t WhichService, ES_Event TheEvent) {
+    if (WhichService < ARRAY_SIZE(EventQueues))
+        return PostToQueue(WhichService, TheEvent);
+    else
+        return FALSE;
+}
+
+/****************************************************************************
+ Function
+   ES_PostFromISR
+ Parameters
+   pPostFunc : the post function that is to take the event
+   ES_Event : The Event to be posted
+ Returns
+   uint8_t : FALSE if the event could not be posted
+ Description
+   posts from an interrupt. With USE_ISR_POST_RING the event and its post
+   function go into the ring and ES_Run makes the call later, otherwise the
+   post function is called straight away.
+ Notes
+   in the ring it takes a few instructions and touches no service queue, so
+   the interrupt's time does not depend on the post function, and the
+   queues and their counters are only changed from the thread side. FALSE
+   then only means the ring was full, see ES_GetIsrPostsDropped; whether
+   the post function succeeds is not known until it is called. Safe from
+   any number of nested interrupts.
+ ****************************************************************************/
+uint8_t ES_PostFromISR(pPostFunc PostFunc, ES_Event ThisEvent) {
+#ifdef USE_ISR_POST_RING
+    uint8_t Slot;
+    // claim a slot
+    do {
+        Slot = IsrPostReserve;
+        if ((uint8_t) (Slot - IsrPostTail) >= ISR_POST_RING_SIZE) {
+            __sync_fetch_and_add(&IsrPostsDropped, 1);
+            return FALSE;
+        }
+    } while (!__sync_bool_compare_and_swap(&IsrPostReserve, Slot, (uint8_t) (Slot + 1)));
+    IsrPostRing[Slot & (ISR_POST_RING_SIZE - 1)].PostFunc = PostFunc;
+    IsrPostRing[Slot & (ISR_POST_RING_SIZE - 1)].Event = ThisEvent;
+    ES_QueueBarrier();
+    // publish ours and everything claimed since, if all before ours is done
+    if (IsrPostHead == Slot) {
+        do {
+            Slot = IsrPostReserve;
+            IsrPostHead = Slot;
+        } while (Slot != IsrPostReserve);
+    }
+#ifdef USE_IDLE_WAIT
+    if (Idling) {
+        WakeIdle();
+    }
+#endif
+#ifdef USE_PREEMPTION
+    // the target's priority is not known until the post, let Schedule see
+    ES_RequestSchedule();
+#endif
+    return TRUE;
+#else
+    return PostFunc(ThisEvent);
+#endif
+}
+
+/****************************************************************************
+ Function
+   ES_Publish
+ Parameters
+   ES_Event : The Event to be posted
+ Returns
+   uint8_t : FALSE if any of the subscribers' queues was full
+ Description
+   posts to the queue of every service subscribed to the event's type
+ Notes
+   one walk over the subscriber bits with no call through a post function
+   per service. All or nothing like ES_PostAll, if any subscriber's queue is
+   full none of them get the event. An event nobody subscribes to is not an
+   error.
+ ****************************************************************************/
+uint8_t ES_Publish(ES_Event ThisEvent) {
+    if (ThisEvent.EventType >= NUMBEROFEVENTS)
+        return FALSE;
+    return PostMulticast(Subscribers[ThisEvent.EventType], ThisEvent);
+}
+
+/****************************************************************************
+ Function
+   ES_Subscribe
+ Parameters
+   uint8_t : Which service (index into ServDescList)
+   ES_EventTyp_t : the type of event it wants from ES_Publish
+ Returns
+   uint8_t : FALSE if WhichService or EventType is out of range
+ Description
+   adds a service to the subscribers of an event type
+ Notes
+   takes effect with the next ES_Publish, safe to call from interrupts
+ ****************************************************************************/
+uint8_t ES_Subscribe(uint8_t WhichService, ES_EventTyp_t EventType) {
+    if ((WhichService >= ARRAY_SIZE(EventQueues)) || (EventType >= NUMBEROFEVENTS))
+        return FALSE;
+    __sync_fetch_and_or(&Subscribers[EventType], (uint32_t) 1 << WhichService);
+    return TRUE;
+}
+
+/****************************************************************************
+ Function
+   ES_Unsubscribe
+ Parameters
+   uint8_t : Which service (index into ServDescList)
+   ES_EventTyp_t : the type of event it no longer wants
+ Returns
+   uint8_t : FALSE if WhichService or EventType is out of range
+ Description
+   removes a service from the subscribers of an event type
+ Notes
+   events already in the service's queue stay there
+ ****************************************************************************/
+uint8_t ES_Unsubscribe(uint8_t WhichService, ES_EventTyp_t EventType) {
+    if ((WhichService >= ARRAY_SIZE(EventQueues)) || (EventType >= NUMBEROFEVENTS))
+        return FALSE;
+    __sync_fetch_and_and(&Subscribers[EventType], ~((uint32_t) 1 << WhichService));
+    return TRUE;
+}
+
+/****************************************************************************
+ Function
+   ES_GetQueueStats
+ Parameters
+   uint8_t : Which service's queue (index into ServDescList)
+   ES_QueueStats_t * : where to put the counters
+ Returns
+   uint8_t : FALSE if WhichService is not a service
+ Description
+   copies out the counters kept for one of the services' queues
+ Notes
+   the counters are updated from interrupts too, so they are a snapshot
+ ****************************************************************************/
+uint8_t ES_GetQueueStats(uint8_t WhichService, ES_QueueStats_t * pStats) {
+    if (WhichService >= ARRAY_SIZE(EventQueues))
+        return FALSE;
+    pStats->Depth = ES_QueueCount(EventQueues[WhichService].pMem);
+    pStats->Capacity = EventQueues[WhichService].Capacity;
+    pStats->Peak = EventQueues[WhichService].Peak;
+    pStats->Dropped = EventQueues[WhichService].Dropped;
+    pStats->Coalesced = EventQueues[WhichService].Coalesced;
+    pStats->Posted = EventQueues[WhichService].Posted;
+    return TRUE;
+}
+
+/****************************************************************************
+ Function
+   ES_GetMulticastFailures
+ Parameters
+   None
+ Returns
+   uint16_t : the number of ES_PostAll and ES_Publish calls that failed
+ Description
+   a failed multicast reached none of its services, the full queues are
+   also counted in their Dropped counters
+ ****************************************************************************/
+uint16_t ES_GetMulticastFailures(void) {
+    return MulticastFailures;
+}
+
+/****************************************************************************
+ Function
+   ES_GetIsrPostsDropped
+ Parameters
+   None
+ Returns
+   uint16_t : the number of ES_PostFromISR calls refused, 0 without
+              USE_ISR_POST_RING
+ Description
+   a refused post was lost because the ring was full, raise
+   ISR_POST_RING_SIZE in ES_Configure.h if this is not 0
+ ****************************************************************************/
+uint16_t ES_GetIsrPostsDropped(void) {
+#ifdef USE_ISR_POST_RING
+    return IsrPostsDropped;
+#else
+    return 0;
+#endif
+}
+
+/****************************************************************************
+ Function
+   ES_GetRunStats
+ Parameters
+   uint8_t : Which service (index into ServDescList)
+   ES_RunStats_t * : where to put the counters
+ Returns
+   uint8_t : FALSE if WhichService is not a service
+ Description
+   copies out the run function times kept for one of the services
+ Notes
+   all zero unless USE_RUN_BUDGETS is defined
+ ****************************************************************************/
+uint8_t ES_GetRunStats(uint8_t WhichService, ES_RunStats_t * pStats) {
+    if (WhichService >= ARRAY_SIZE(ServDescList))
+        return FALSE;
+    pStats->Budget = ServDescList[WhichService].BudgetTicks / ES_RUN_CLOCK_TICKS_PER_US;
+#ifdef USE_RUN_BUDGETS
+    pStats->Worst = RunTimes[WhichService].WorstTicks / ES_RUN_CLOCK_TICKS_PER_US;
+    pStats->Overruns = RunTimes[WhichService].Overruns;
+    pStats->Runs = RunTimes[WhichService].Runs;
+#else
+    pStats->Worst = 0;
+    pStats->Overruns = 0;
+    pStats->Runs = 0;
+#endif
+    return TRUE;
+}
+
+/****************************************************************************
+ Function
+   ES_GetIdleStats
+ Parameters
+   ES_IdleStats_t * : where to put the counters
+ Returns
+   None
+ Description
+   copies out how often ES_Run has gone idle and how long it took to wake
+ Notes
+   all zero unless USE_IDLE_WAIT is defined
+ ****************************************************************************/
+void ES_GetIdleStats(ES_IdleStats_t * pStats) {
+#ifdef USE_IDLE_WAIT
+    *pStats = IdleStats;
+    pStats->AverageWake = (IdleStats.Wakes != 0) ?
+            (uint32_t) (TotalWake / IdleStats.Wakes) : 0;
+#else
+    pStats->Sleeps = 0;
+    pStats->Wakes = 0;
+    pStats->WorstWake = 0;
+    pStats->AverageWake = 0;
+#endif
+}
+
+/****************************************************************************
+ Function
+   ES_ResetRunStats
+ Parameters
+   None
+ Returns
+   None
+ Description
+   zeroes the worst case times and the counters of every service
+ Notes
+   call it from a run function, ES_Run updates the times between calls
+ ****************************************************************************/
+void ES_ResetRunStats(void) {
+#ifdef USE_RUN_BUDGETS
+    unsigned char i;
+    for (i = 0; i < ARRAY_SIZE(RunTimes); i++) {
+        RunTimes[i].WorstTicks = 0;
+        RunTimes[i].Overruns = 0;
+        RunTimes[i].Runs = 0;
+    }
+#endif
+}
+
+/****************************************************************************
+ Function
+   ES_ResetQueueStats
+ Parameters
+   None
+ Returns
+   None
+ Description
+   zeroes the peak, dropped and posted counters of every service's queue,
+   and the multicast failures
+ Notes
+   Peak restarts from the current depth of the queue. Only call this after
+   ES_Initialize, the counters start out at zero.
+ ****************************************************************************/
+void ES_ResetQueueStats(void) {
+    unsigned char i;
+    for (i = 0; i < ARRAY_SIZE(EventQueues); i++) {
+        EventQueues[i].Dropped = 0;
+        EventQueues[i].Coalesced = 0;
+        EventQueues[i].Posted = 0;
+        EventQueues[i].Peak = ES_QueueCount(EventQueues[i].pMem);
+    }
+    MulticastFailures = 0;
+}
+
+/****************************************************************************
+ Function
+   ES_DeferEvent
+ Parameters
+   ES_Event * : the deferral queue, set up with ES_InitQueue
+   ES_Event : The Event to be deferred
+ Returns
+   uint8_t : FALSE if the deferral queue is full
+ Description
+   parks an event that the current state can not handle yet, to be put back
+   in the service's queue by ES_RecallEvents
+ Notes
+   a deferral queue belongs to one service and is only used from its run
+   function
+ ****************************************************************************/
+uint8_t ES_DeferEvent(ES_Event * pDeferQueue, ES_Event ThisEvent) {
+    if (ES_EnQueueFIFO(pDeferQueue, ThisEvent) != TRUE)
+        return FALSE;
+#if NUM_PAYLOAD_POOLS > 0
+    // keep the payload past the end of this run function, the hold passes
+    // to the service's queue when the event is recalled
+    if (ES_IsPayloadEvent(ThisEvent)) {
+        ES_PayloadRetain(ThisEvent.EventParam);
+    }
+#endif
+    return TRUE;
+}
+
+/****************************************************************************
+ Function
+   ES_RecallEvents
+ Parameters
+   uint8_t : Which service's queue to put them in (index into ServDescList)
+   ES_Event * : the deferral queue
+ Returns
+   uint8_t : the number of events recalled
+ Description
+   moves the deferred events to the front of the service's queue, in the
+   order they were deferred, ahead of anything already waiting there
+ Notes
+   only call this from the service's own run function. Events go back newest
+   first with ES_EnQueueLIFO, so if the queue fills up the oldest stay
+   deferred for the next recall. Nothing is counted as posted.
+ ****************************************************************************/
+uint8_t ES_RecallEvents(uint8_t WhichService, ES_Event * pDeferQueue) {
+    ES_Event ThisEvent;
+    uint8_t Recalled = 0;
+
+    if (WhichService >= ARRAY_SIZE(EventQueues))
+        return 0;
+    while (!ES_IsQueueEmpty(pDeferQueue)) {
+        ES_DeQueueLIFO(pDeferQueue, &ThisEvent);
+        if (ES_EnQueueLIFO(EventQueues[WhichService].pMem, ThisEvent) != TRUE) {
+            ES_EnQueueFIFO(pDeferQueue, ThisEvent); // put it back
+            break;
+        }
+        Recalled++;
+    }
+    if (Recalled != 0) {
+        ES_SetReady((uint32_t) 1 << WhichService); // show queue as non-empty
+        UpdatePeak(&EventQueues[WhichService]);
+    }
+    return Recalled;
+}
+
+
+//*********************************
+// private functions
+//*********************************
+
+/****************************************************************************
+ Function
+   PostToQueue
+ Parameters
+   uint8_t : Which service to post to, already range checked
+   ES_Event : The Event to be posted
+ Returns
+   uint8_t : FALSE if the queue was full
+ Description
+   adds the event to the service's queue and marks it ready
+ Notes
+   called from interrupts as well as the main line
+ ****************************************************************************/
+static uint8_t PostToQueue(uint8_t WhichService, ES_Event ThisEvent) {
+    if (AddToQueue(WhichService, ThisEvent) != TRUE)
+        return FALSE;
+    ES_SetReady((uint32_t) 1 << WhichService); // show queue as non-empty
+    return TRUE;
+}
+
+/****************************************************************************
+ Function
+   PostMulticast
+ Parameters
+   uint32_t : the services to post to, bit n for service n
+   ES_Event : The Event to be posted
+ Returns
+   uint8_t : FALSE if any of the queues was full, and then none get it
+ Description
+   posts to several services' queues in two passes. The first makes sure
+   every queue has room, the second adds the event to each one, and then
+   all their Ready bits are set at once.
+ Notes
+   interrupts are off for both passes, so no other post can take the room
+   found in the first one. A coalesced event needs room in the queue even if
+   it would have merged with one already waiting.
+ ****************************************************************************/
+static uint8_t PostMulticast(uint32_t Targets, ES_Event ThisEvent) {
+    uint32_t Left, ThisBit;
+    uint8_t WhichService;
+    uint8_t ReturnVal = TRUE;
+
+#if NUM_PAYLOAD_POOLS > 0
+    // hold the payload so that one no service takes is freed
+    if (ES_IsPayloadEvent(ThisEvent)) {
+        ES_PayloadRetain(ThisEvent.EventParam);
+    }
+#endif
+    EnterCritical();
+    for (Left = Targets; Left != 0; Left &= ~ThisBit) {
+        WhichService = ES_HighestReady(Left);
+        ThisBit = (uint32_t) 1 << WhichService;
+        if (ES_QueueRoom(EventQueues[WhichService].pMem) == 0) {
+            EventQueues[WhichService].Dropped++;
+            ReturnVal = FALSE;
+        }
+    }
+    if (ReturnVal == TRUE) {
+        for (Left = Targets; Left != 0; Left &= ~ThisBit) {
+            WhichService = ES_HighestReady(Left);
+            ThisBit = (uint32_t) 1 << WhichService;
+            AddToQueue(WhichService, ThisEvent);
+        }
+        ES_SetReady(Targets);
+    } else {
+        MulticastFailures++;
+    }
+    ExitCritical();
+#if NUM_PAYLOAD_POOLS > 0
+    if (ES_IsPayloadEvent(ThisEvent)) {
+        ES_PayloadRelease(ThisEvent.EventParam);
+    }
+#endif
+    return ReturnVal;
+}
+
+/****************************************************************************
+ Function
+   AddToQueue
+ Parameters
+   uint8_t : Which service to post to, already range checked
+   ES_Event : The Event to be posted
+ Returns
+   uint8_t : FALSE if the queue was full
+ Description
+   adds the event to the service's queue and keeps the queue counters, the
+   caller sets the Ready bit
+ Notes
+   called from interrupts as well as the main line, so the counters are only
+   changed with atomic operations
+ ****************************************************************************/
+static uint8_t AddToQueue(uint8_t WhichService, ES_Event ThisEvent) {
+    ES_QueueDesc_t *pDesc = &EventQueues[WhichService];
+
+#if NUM_PAYLOAD_POOLS > 0
+    // the queue holds a reference until the run function has seen it. If
+    // it can not take the event, a payload nobody else holds is freed.
+    // Payload events are never coalesced, that would lose a reference.
+    if (ES_IsPayloadEvent(ThisEvent)) {
+        ES_PayloadRetain(ThisEvent.EventParam);
+        if (ES_EnQueueFIFOMulti(pDesc->pMem, ThisEvent) != TRUE) {
+            ES_PayloadRelease(ThisEvent.EventParam);
+            __sync_fetch_and_add(&pDesc->Dropped, 1);
+            return FALSE;
+        }
+        __sync_fetch_and_add(&pDesc->Posted, 1);
+        UpdatePeak(pDesc);
+        return TRUE;
+    }
+#endif
+#if NUM_COALESCED_EVENTS > 0
+    if ((ThisEvent.EventType < NUMBEROFEVENTS) &&
+            (CoalesceBit[ThisEvent.EventType] != 0)) {
+        return PostCoalesced(WhichService, ThisEvent);
+    }
+#endif
+    if (ES_EnQueueFIFOMulti(pDesc->pMem, ThisEvent) != TRUE) {
+        __sync_fetch_and_add(&pDesc->Dropped, 1);
+        return FALSE;
+    }
+    __sync_fetch_and_add(&pDesc->Posted, 1);
+    UpdatePeak(pDesc);
+    return TRUE;
+}
+
+#if NUM_COALESCED_EVENTS > 0
+/****************************************************************************
+ Function
+   PostCoalesced
+ Parameters
+   uint8_t : Which service to post to, already range checked
+   ES_Event : The Event to be posted, one of COALESCED_EVENTS
+ Returns
+   uint8_t : FALSE if the queue was full
+ Description
+   if an event of the same type is already waiting in the service's queue,
+   gives it this EventParam, otherwise adds the event like AddToQueue
+ Notes
+   the pending mask only says where to look, ES_CoalesceQueued checks that
+   the event is really still there. Interrupts are off so that no other post
+   gets between finding the entry and updating it.
+ ****************************************************************************/
+static uint8_t PostCoalesced(uint8_t WhichService, ES_Event ThisEvent) {
+    ES_QueueDesc_t *pDesc = &EventQueues[WhichService];
+    uint8_t Which = CoalesceBit[ThisEvent.EventType] - 1;
+    uint32_t Bit = (uint32_t) 1 << Which;
+    uint8_t Entry;
+    uint8_t ReturnVal = TRUE;
+
+    EnterCritical();
+    if ((pDesc->Pending & Bit) &&
+            ES_CoalesceQueued(pDesc->pMem, pDesc->PendingEntry[Which], ThisEvent)) {
+        pDesc->Coalesced++;
+    } else {
+        Entry = ES_QueueNextEntry(pDesc->pMem);
+        if (ES_EnQueueFIFOMulti(pDesc->pMem, ThisEvent) == TRUE) {
+            pDesc->PendingEntry[Which] = Entry;
+            __sync_fetch_and_or(&pDesc->Pending, Bit);
+            pDesc->Posted++;
+            UpdatePeak(pDesc);
+        } else {
+            pDesc->Dropped++;
+            ReturnVal = FALSE;
+        }
+    }
+    ExitCritical();
+    return ReturnVal;
+}
+#endif
+
+#ifdef USE_RUN_BUDGETS
+/****************************************************************************
+ Function
+   CheckRunTime
+ Parameters
+   uint8_t : the service whose run function just returned
+   uint32_t : how long it took, in ES_ReadRunClock ticks
+ Returns
+   None
+ Description
+   keeps the service's worst case and counts a call that went over its
+   budget, posting ES_OVERRUN if RUN_OVERRUN_POST_FUNC is defined
+ ****************************************************************************/
+static void CheckRunTime(uint8_t WhichService, uint32_t Ticks) {
+    ES_RunTimes_t *pTimes = &RunTimes[WhichService];
+
+    pTimes->Runs++;
+    if (Ticks > pTimes->WorstTicks) {
+        pTimes->WorstTicks = Ticks;
+    }
+    if ((ServDescList[WhichService].BudgetTicks != 0) &&
+            (Ticks > ServDescList[WhichService].BudgetTicks)) {
+        pTimes->Overruns++;
+#ifdef RUN_OVERRUN_POST_FUNC
+        {
+            ES_Event OverrunEvent;
+            OverrunEvent.EventType = ES_OVERRUN;
+            OverrunEvent.EventParam = WhichService;
+            RUN_OVERRUN_POST_FUNC(OverrunEvent);
+        }
+#endif
+    }
+}
+#endif
+
+/****************************************************************************
+ Function
+   RunService
+ Parameters
+   uint8_t : the service whose event it is
+   RunFunc_t * : its run function
+   ES_Event : the event, just taken from its queue
+   uint8_t : its entry number in the queue, from ES_QueueNextOut
+ Returns
+   uint8_t : FALSE if the run function returned ES_ERROR
+ Description
+   hands an event to a service's run function, keeping the coalescing,
+   run time and payload bookkeeping that goes with it. That is done for a
+   run function that returned ES_ERROR too, before the error goes back
+ Notes
+   with USE_PREEMPTION the run time includes any services that preempted it
+ ****************************************************************************/
+static inline uint8_t RunService(uint8_t WhichService, RunFunc_t *RunFunc,
+        ES_Event ThisEvent, uint8_t Entry) {
+    ES_EventTyp_t Result;
+#ifdef USE_RUN_BUDGETS
+    uint32_t Start;
+#endif
+#if NUM_COALESCED_EVENTS > 0
+    ES_QueueDesc_t *pDesc = &EventQueues[WhichService];
+    uint8_t Which;
+
+    // once it is out of the queue, the next one of its type is added. A post
+    // since the dequeue may have added one already, so the bit is only
+    // cleared if the pending entry is the one just taken out
+    if ((pDesc->Pending != 0) && (ThisEvent.EventType < NUMBEROFEVENTS) &&
+            (CoalesceBit[ThisEvent.EventType] != 0)) {
+        Which = CoalesceBit[ThisEvent.EventType] - 1;
+        EnterCritical();
+        if (pDesc->PendingEntry[Which] == Entry) {
+            __sync_fetch_and_and(&pDesc->Pending, ~((uint32_t) 1 << Which));
+        }
+        ExitCritical();
+    }
+#endif
+    if (ThisEvent.EventType == ES_TIMEOUT) {
+        // one from before its timer was restarted or stopped is dropped here
+        if (ES_Timer_CheckTimeout(&ThisEvent) == FALSE) {
+            return TRUE;
+        }
+    }
+#ifdef USE_RUN_BUDGETS
+    Start = ES_ReadRunClock();
+#endif
+    Result = RunFunc(ThisEvent).EventType;
+#ifdef USE_RUN_BUDGETS
+    CheckRunTime(WhichService, ES_ReadRunClock() - Start);
+#endif
+#if NUM_PAYLOAD_POOLS > 0
+    // this queue's hold on the payload ends with the run function, even one
+    // that failed
+    if (ES_IsPayloadEvent(ThisEvent)) {
+        ES_PayloadRelease(ThisEvent.EventParam);
+    }
+#endif
+    return (Result != ES_ERROR);
+}
+
+#ifdef USE_PREEMPTION
+/****************************************************************************
+ Function
+   Schedule
+ Parameters
+   None
+ Returns
+   None
+ Description
+   runs one event at a time from the highest priority ready service above
+   the run function it interrupted, until there are none left above it or a
+   run function has failed
+ Notes
+   called from ES_Run with nothing active, and from the software interrupt
+   on top of whatever run function was active when a higher priority service
+   was posted to. Each call only takes events for services above the one it
+   preempted, so a queue is never taken from by two nested calls at once.
+   The pick, the dequeue and the change of ActivePrior are done with
+   interrupts off so that a post can not see them half done.
+ ****************************************************************************/
+static void Schedule(void) {
+    int8_t BasePrior = ActivePrior;
+    uint8_t HighestPrior;
+    uint8_t Found, Entry;
+    uint32_t ReadyAbove;
+    ES_Event *pQueue;
+    ES_Event ThisEvent;
+
+    do {
+        Found = FALSE;
+        DrainIsrPosts();
+        EnterCritical();
+        // nothing more runs once one has failed, ES_Run is about to return
+        ReadyAbove = RunFailed ? 0 : (Ready & ES_ReadyAbove(BasePrior));
+        if (ReadyAbove != 0) {
+            HighestPrior = ES_HighestReady(ReadyAbove);
+            pQueue = EventQueues[HighestPrior].pMem;
+            if (!ES_IsQueueEmpty(pQueue)) {
+                Found = TRUE;
+                ActivePrior = HighestPrior;
+                Entry = ES_QueueNextOut(pQueue);
+                if (ES_DeQueue(pQueue, &ThisEvent) == 0) {
+                    ES_ClearReady((uint32_t) 1 << HighestPrior);
+                }
+            } else {
+                ES_ClearReady((uint32_t) 1 << HighestPrior);
+            }
+        } else {
+            ActivePrior = BasePrior; // back to the run function we preempted
+        }
+        ExitCritical();
+        if (Found) {
+            if (RunService(HighestPrior, ServDescList[HighestPrior].RunFunc,
+                    ThisEvent, Entry) != TRUE) {
+                RunFailed = TRUE; // ES_Run returns FailedRun
+            }
+        }
+    } while (ReadyAbove != 0);
+}
+
+/****************************************************************************
+ Function
+   CoreSoftware0Handler
+ Parameters
+   None
+ Returns
+   None
+ Description
+   requested by a post to a service above the active run function, it runs
+   the scheduler on top of that run function
+ Notes
+   it drops to IPL 0 first, so a post from a run function it calls can take
+   it again and nest. It saves context on the stack (soft) so that it can.
+ ****************************************************************************/
+void __ISR(_CORE_SOFTWARE_0_VECTOR, ipl1soft) CoreSoftware0Handler(void) {
+    _CP0_BIC_CAUSE(_CP0_CAUSE_IP0_MASK);
+    INTClearFlag(INT_CS0);
+    __builtin_mtc0(12, 0, __builtin_mfc0(12, 0) & ~_CP0_STATUS_IPL_MASK);
+    Schedule();
+}
+#endif
+
+#ifdef USE_ISR_POST_RING
+/****************************************************************************
+ Function
+   DrainIsrPosts
+ Parameters
+   None
+ Returns
+   None
+ Description
+   calls the post function of every event that interrupts have left in the
+   ring, oldest first, moving them into the service queues
+ Notes
+   only one call takes from the ring at a time. With USE_PREEMPTION a
+   Schedule nested on top of one that is draining leaves the ring to it,
+   and the outer one looks again after it lets go, so a post that came in
+   just as it finished is not left behind.
+ ****************************************************************************/
+static void DrainIsrPosts(void) {
+    uint8_t Tail;
+    ES_IsrPost_t ThisPost;
+
+    do {
+        if (!__sync_bool_compare_and_swap(&IsrPostDraining, FALSE, TRUE)) {
+            return;
+        }
+        Tail = IsrPostTail;
+        while (IsrPostHead != Tail) {
+            ThisPost = IsrPostRing[Tail & (ISR_POST_RING_SIZE - 1)];
+            ES_QueueBarrier();
+            IsrPostTail = ++Tail; // the slot is free again
+            ThisPost.PostFunc(ThisPost.Event);
+        }
+        IsrPostDraining = FALSE;
+    } while (IsrPostsWaiting());
+}
+#endif
+
+#ifdef USE_IDLE_WAIT
+/****************************************************************************
+ Function
+   IdleUntilEvent
+ Parameters
+   None
  Returns
-   ES_Return_t : FailedRun is any of the run functions failed during execution
+   None
  Description
-   This is the main framework function. It searches through the state
-   machines to find one with a non-empty queue and then executes the
-   state machine to process the event in its queue.
-   while all the queues are empty, it searches for system generated or
-   user generated events.
+   waits with the CPU idle until an interrupt posts an event, a key comes
+   in or an event checker is due
  Notes
-   this function only returns in case of an error
- Author
-   J. Edward Carryer, 10/23/11,
-   M. Dunne, 2013.09.18
+   interrupts are off from the last look at Ready until the WAIT, so a post
+   can not slip in between and leave the CPU asleep with an event waiting.
+   The PIC32 still leaves WAIT for an interrupt while they are off, and
+   takes the interrupt once they are back on. Interrupts that post nothing,
+   like most timer ticks, just go round the loop again without calling the
+   checkers. With USE_TICKLESS_TIMERS there is no tick, so ES_IdleWait has
+   the core timer interrupt at the next checker deadline as well as the next
+   timer. Built for a host it sleeps on a futex on Ready instead, no longer
+   than the time to the next timer or checker deadline.
  ****************************************************************************/
-ES_Return_t ES_Run(void) {
-    // make these static to improve speed
-    uint8_t HighestPrior;
-    static ES_Event ThisEvent;
-    uint8_t CurService;
-    uint8_t CurServiceMask;
-
-    while (1) { // stay here unless we detect an error condition
+static void IdleUntilEvent(void) {
+    uint32_t Timeout;
+    uint8_t Slept;
+#ifndef USE_KEYBOARD_INPUT
+    uint32_t CheckerTime;
+#endif
 
-        // loop through the list executing the run functions for services
-        // with a non-empty queue
-        while (Ready != 0) {
-            //if (IsTransmitEmpty()) {
-                 //printf("handling queues: %X\r\n", Ready);
-            //}
-            for (CurService = 0; CurService < NUM_SERVICES; CurService++) {
-                CurServiceMask = 1 << CurService;
-                //printf("handling queue: %X: %X: %X\r\n", CurService,Ready,Ready & CurServiceMask);
-                if (Ready & CurServiceMask) {
-                    if (ES_DeQueue(EventQueues[CurService].pMem, &ThisEvent) == 0) {
-                        Ready &= ~CurServiceMask; // mark queue as now empty
-                    }
-                    if (ServDescList[CurService].RunFunc(ThisEvent).EventType == ES_ERROR) {
-                        return FailedRun;
-                    }
-                }
-            }
-        }
-        // all the queues are empty, so look for new system or user detected events
-        if (CheckSystemEvents() == FALSE)
+    while (1) {
+        Timeout = ES_Timer_GetTimeToExpiry();
 #ifndef USE_KEYBOARD_INPUT
-            ES_CheckUserEvents();
+        CheckerTime = ES_CheckerIdleTime();
+        if (CheckerTime < Timeout) {
+            Timeout = CheckerTime;
+        }
+#endif
+        if (Timeout == 0) {
+            return; // a checker is due now
+        }
+        Slept = FALSE;
+        EnterCritical();
+#ifdef USE_KEYBOARD_INPUT
+        if ((Ready == 0) && !IsrPostsWaiting() && IsReceiveEmpty()) {
 #else
-            ;
+        if ((Ready == 0) && !IsrPostsWaiting()) {
+#endif
+            Idling = TRUE;
+            Slept = TRUE;
+            IdleStats.Sleeps++;
+            ES_IdleWait(Timeout);
+        }
+        ExitCritical(); // the interrupt that ended the wait runs here
+        if (Slept == FALSE) {
+            return; // something came in before it could sleep
+        }
+        if (Idling == FALSE) { // a post woke it up
+            uint32_t Latency = ES_ReadRunClock() - WakeStamp;
+            IdleStats.Wakes++;
+            TotalWake += Latency;
+            if (Latency > IdleStats.WorstWake) {
+                IdleStats.WorstWake = Latency;
+            }
+            return;
+        }
+        Idling = FALSE;
+#ifdef USE_KEYBOARD_INPUT
+        if (!IsReceiveEmpty()) {
+            return;
+        }
 #endif
-
     }
 }
 
 /****************************************************************************
  Function
-   ES_PostAll
+   WakeIdle
  Parameters
-   ES_Event : The Event to be posted
+   None
  Returns
-   uint8_t : FALSE if any of the post functions failed during execution
+   None
  Description
-   posts to all of the services' queues 
+   called by a post that finds ES_Run idle, notes the time for the latency
+   counters and, on a host, wakes it from its futex
  Notes
-
- Author
-   J. Edward Carryer, 01/15/12,
+   only the first post to find it idle does this, the compare and swap keeps
+   a nested interrupt from taking the time stamp again
  ****************************************************************************/
-uint8_t ES_PostAll(ES_Event ThisEvent) {
-
-    unsigned char i;
-    // loop through the list executing the post functions
-    for (i = 0; i < ARRAY_SIZE(EventQueues); i++) {
-        if (ES_EnQueueFIFO(EventQueues[i].pMem, ThisEvent) != TRUE) {
-            break; // this is a failed post
-        } else {
-            Ready |= (1 << i); // show queue as non-empty
-        }
-    }
-    if (i == ARRAY_SIZE(EventQueues)) { // if no failures
-        return (TRUE);
-    } else {
-        return (FALSE);
+static void WakeIdle(void) {
+    if (__sync_bool_compare_and_swap(&Idling, TRUE, FALSE)) {
+        WakeStamp = ES_ReadRunClock();
+#ifndef __PIC32MX__
+        syscall(SYS_futex, &Ready, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
     }
 }
+#endif
 
 /****************************************************************************
  Function
-   ES_PostToService
+   UpdatePeak
  Parameters
-   uint8_t : Which service to post to (index into ServDescList)
-   ES_Event : The Event to be posted
+   ES_QueueDesc_t * : the queue that has just grown
  Returns
-   uint8_t : FALSE if the post function failed during execution
+   None
  Description
-   posts to one of the services' queues
- Notes
-   used by the timer library to associate a timer with a state machine
- Author
-   J. Edward Carryer, 01/16/12,
+   raises the queue's high water mark to its current depth, unless an
+   interrupt got in first with a higher one
  ****************************************************************************/
-uint8_t ES_PostToService(uint8_t WhichService, ES_Event TheEvent) {
-    if ((WhichService < ARRAY_SIZE(EventQueues)) &&
-            (ES_EnQueueFIFO(EventQueues[WhichService].pMem, TheEvent) ==
-            TRUE)) {
-        Ready |= (1 << WhichService); // show queue as non-empty
-        return TRUE;
-    } else
-        return FALSE;
+static void UpdatePeak(ES_QueueDesc_t *pDesc) {
+    uint8_t Depth, Peak;
+
+    Depth = ES_QueueCount(pDesc->pMem);
+    do {
+        Peak = pDesc->Peak;
+    } while ((Depth > Peak) &&
+            !__sync_bool_compare_and_swap(&pDesc->Peak, Peak, Depth));
 }
 
-
-//*********************************
-// private functions
-//*********************************
-
 /****************************************************************************
  Function
    CheckSystemEvents
@@ -1043,6 +4042,311 @@ static uint8_t CheckSystemEvents(void) {
 }
 
 /*------------------------------- Footnotes -------------------------------*/
+#ifdef ES_RUN_BENCHMARK
+/* Dispatch latency benchmark. Make every SERVICE_LIST entry in ES_Configure.h
+ * SERVICE(InitBenchService, RunBenchService, PostBenchService, 3, 1, 0), with 8 or
+ * more entries for the most interesting numbers. Every service below the top
+ * one keeps its own queue saturated by re-posting to itself, and every few low priority
+ * events, whichever service is running posts to the top service. The time from
+ * that post until the top service's run function is entered is the dispatch
+ * latency, reported in core timer ticks (SYSCLK/2). On a host, make bench in
+ * projects_and_templates/HostTest builds it with 8 such services. */
+#include <stdio.h>
+#include <xc.h>
+
+#define BENCH_SAMPLES 1000
+#define BENCH_POST_EVERY 4
+#define BENCH_WORK_TICKS 200
+
+static uint32_t BenchPostStamp;
+static uint32_t BenchMin = 0xFFFFFFFF, BenchMax, BenchTotal;
+static uint16_t BenchSamples, BenchLowCount;
+
+uint8_t InitBenchService(uint8_t Priority) {
+    ES_Event ThisEvent;
+    // every lower priority service starts with a full queue of work
+    ThisEvent.EventType = ES_NO_EVENT;
+    ThisEvent.EventParam = Priority;
+    if (Priority != (NUM_SERVICES - 1)) {
+        while (ES_PostToService(Priority, ThisEvent) == TRUE);
+    }
+    return TRUE;
+}
+
+uint8_t PostBenchService(ES_Event ThisEvent) {
+    BenchPostStamp = _CP0_GET_COUNT();
+    return ES_PostToService(NUM_SERVICES - 1, ThisEvent);
+}
+
+ES_Event RunBenchService(ES_Event ThisEvent) {
+    uint32_t Now = _CP0_GET_COUNT();
+    uint32_t Latency;
+
+    if (ThisEvent.EventParam == (NUM_SERVICES - 1)) {
+        Latency = Now - BenchPostStamp;
+        BenchTotal += Latency;
+        if (Latency < BenchMin) {
+            BenchMin = Latency;
+        }
+        if (Latency > BenchMax) {
+            BenchMax = Latency;
+        }
+        if (++BenchSamples == BENCH_SAMPLES) {
+            ThisEvent.EventType = ES_ERROR; // makes ES_Run return to main
+        }
+        return ThisEvent;
+    }
+    // simulate a run function doing a little work, then stay saturated
+    while ((_CP0_GET_COUNT() - Now) < BENCH_WORK_TICKS);
+    ES_PostToService(ThisEvent.EventParam, ThisEvent);
+    if ((++BenchLowCount % BENCH_POST_EVERY) == 0) {
+        ThisEvent.EventParam = NUM_SERVICES - 1;
+        PostBenchService(ThisEvent);
+    }
+    ThisEvent.EventType = ES_NO_EVENT;
+    return ThisEvent;
+}
+
+int main(void) {
+    BOARD_Init();
+    printf("ES_Run dispatch latency benchmark, %d services, %d ticks of work per low priority event\r\n",
+            NUM_SERVICES, BENCH_WORK_TICKS);
+    if (ES_Initialize() == Success) {
+        ES_Run();
+    }
+    if (BenchSamples == 0) {
+        printf("no samples, ES_Initialize failed\r\n");
+        return 1;
+    }
+    printf("top priority latency over %u samples: min %lu avg %lu max %lu ticks\r\n",
+            BenchSamples, (unsigned long) BenchMin,
+            (unsigned long) (BenchTotal / BenchSamples), (unsigned long) BenchMax);
+#ifdef __PIC32MX__
+    while (1);
+#else
+    return 0;
+#endif
+}
+#endif
+
+#ifdef ES_RUN_BATCH_BENCHMARK
+/* Dispatch throughput benchmark. Make every SERVICE_LIST entry in
+ * ES_Configure.h SERVICE(InitBenchService, RunBenchService, PostBenchService,
+ * 16, Batch, 0), and run it once with a Batch of 1 and once with a bigger one.
+ * Service 0 plays the part of an interrupt or a keyboard, each time it runs it
+ * posts a burst of events to every other service, whose run functions do next
+ * to nothing, so the time is all spent in ES_Run. On a host, make bench in
+ * projects_and_templates/HostTest builds it with 8 services and a Batch of 1
+ * and of 8. There the two show no gain from batching, they come out the same
+ * to within the few percent that runs differ by. The lookup a batch saves is
+ * one count leading zeros on Ready, small next to the rest of a dispatch. */
+#include <stdio.h>
+#include <xc.h>
+
+#define BENCH_EVENTS 200000UL
+#define BENCH_BURST 8
+#define BENCH_TICKS_PER_SECOND 40000000ULL // the core timer counts at SYSCLK/2
+
+static uint32_t BenchHandled;
+
+uint8_t InitBenchService(uint8_t Priority) {
+    ES_Event ThisEvent;
+    // the feeder gets the first turn
+    ThisEvent.EventType = ES_NO_EVENT;
+    ThisEvent.EventParam = 0;
+    if (Priority == 0) {
+        return ES_PostToService(0, ThisEvent);
+    }
+    return TRUE;
+}
+
+uint8_t PostBenchService(ES_Event ThisEvent) {
+    return ES_PostToService(ThisEvent.EventParam, ThisEvent);
+}
+
+ES_Event RunBenchService(ES_Event ThisEvent) {
+    uint8_t i, Service;
+
+    if (ThisEvent.EventParam != 0) {
+        if (++BenchHandled == BENCH_EVENTS) {
+            ThisEvent.EventType = ES_ERROR; // makes ES_Run return to main
+        }
+        return ThisEvent;
+    }
+    // the feeder only runs once the others are idle, refill them all
+    for (Service = 1; Service < NUM_SERVICES; Service++) {
+        ThisEvent.EventParam = Service;
+        for (i = 0; i < BENCH_BURST; i++) {
+            PostBenchService(ThisEvent);
+        }
+    }
+    ThisEvent.EventParam = 0;
+    PostBenchService(ThisEvent);
+    ThisEvent.EventType = ES_NO_EVENT;
+    return ThisEvent;
+}
+
+int main(void) {
+    uint32_t Start, Ticks;
+    BOARD_Init();
+    printf("ES_Run throughput benchmark, %d services, bursts of %d, batch of %d\r\n",
+            NUM_SERVICES, BENCH_BURST, ServDescList[NUM_SERVICES - 1].Batch);
+    if (ES_Initialize() != Success) {
+        return 1;
+    }
+    Start = _CP0_GET_COUNT();
+    ES_Run();
+    Ticks = _CP0_GET_COUNT() - Start;
+    printf("%lu events in %lu ticks, %lu events per second\r\n",
+            (unsigned long) BenchHandled, (unsigned long) Ticks,
+            (unsigned long) (BenchHandled * BENCH_TICKS_PER_SECOND / Ticks));
+#ifdef __PIC32MX__
+    while (1);
+#else
+    return 0;
+#endif
+}
+#endif
+
+#ifdef ES_PREEMPT_BENCHMARK
+/* Response time benchmark. Make every SERVICE_LIST entry in ES_Configure.h
+ * SERVICE(InitPreemptService, RunPreemptService, PostPreemptService, 4, 1, 0),
+ * and run it once with USE_PREEMPTION and once without. The services below
+ * the top one keep themselves busy with long run functions, while the core
+ * timer interrupt posts to the top one at an unrelated rate. The time from
+ * that post to the top run function starting is the response time. Built for
+ * a host the interrupt is SIGALRM from an interval timer and the software
+ * interrupt that preempts is SIGUSR1, see projects_and_templates/HostTest,
+ * where make bench_preempt builds and runs it both ways. */
+#include <stdio.h>
+#include <xc.h>
+#ifdef __PIC32MX__
+#include <peripheral/timer.h>
+#else
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+#ifdef USE_TICKLESS_TIMERS
+#error "the benchmark uses the core timer interrupt, undefine USE_TICKLESS_TIMERS"
+#endif
+
+#define PREEMPT_SAMPLES 2000
+#define PREEMPT_ISR_TICKS 3001 // so the posts drift across the busy work
+#define PREEMPT_WORK_TICKS 4000 // each background run function, 100us
+
+static volatile uint32_t PostStamp;
+static volatile uint8_t Waiting; // the last post has not been answered yet
+static uint32_t MinLatency = 0xFFFFFFFFUL, MaxLatency;
+static uint64_t TotalLatency;
+static uint16_t Samples;
+
+#ifdef __PIC32MX__
+void __ISR(_CORE_TIMER_VECTOR, ipl2auto) CoreTimerHandler(void) {
+#else
+static void PreemptSignalHandler(int Signal) {
+#endif
+    ES_Event ThisEvent;
+#ifdef __PIC32MX__
+    mCTClearIntFlag();
+    UpdateCoreTimer(PREEMPT_ISR_TICKS);
+#endif
+    if (Waiting) {
+        return; // or the stamp would be overwritten before it is read
+    }
+    Waiting = TRUE;
+    ThisEvent.EventType = ES_NO_EVENT;
+    ThisEvent.EventParam = NUM_SERVICES - 1;
+    PostStamp = _CP0_GET_COUNT();
+    ES_PostToService(NUM_SERVICES - 1, ThisEvent);
+}
+
+uint8_t InitPreemptService(uint8_t Priority) {
+    ES_Event ThisEvent;
+    // the background services start out busy, the top one waits for the timer
+    ThisEvent.EventType = ES_NO_EVENT;
+    ThisEvent.EventParam = Priority;
+    if (Priority != NUM_SERVICES - 1) {
+        return ES_PostToService(Priority, ThisEvent);
+    }
+    return TRUE;
+}
+
+uint8_t PostPreemptService(ES_Event ThisEvent) {
+    return ES_PostToService(ThisEvent.EventParam, ThisEvent);
+}
+
+ES_Event RunPreemptService(ES_Event ThisEvent) {
+    uint32_t Start, Latency;
+
+    if (ThisEvent.EventParam == NUM_SERVICES - 1) {
+        Latency = _CP0_GET_COUNT() - PostStamp;
+        Waiting = FALSE;
+        if (Latency < MinLatency) {
+            MinLatency = Latency;
+        }
+        if (Latency > MaxLatency) {
+            MaxLatency = Latency;
+        }
+        TotalLatency += Latency;
+        if (++Samples == PREEMPT_SAMPLES) {
+            ThisEvent.EventType = ES_ERROR; // makes ES_Run return to main
+        }
+        return ThisEvent;
+    }
+    // a background service, spin for a while and then go again
+    Start = _CP0_GET_COUNT();
+    while ((_CP0_GET_COUNT() - Start) < PREEMPT_WORK_TICKS);
+    PostPreemptService(ThisEvent);
+    return ThisEvent;
+}
+
+int main(void) {
+#ifndef __PIC32MX__
+    struct itimerval Interval = {{0, PREEMPT_ISR_TICKS / ES_RUN_CLOCK_TICKS_PER_US},
+                                 {0, PREEMPT_ISR_TICKS / ES_RUN_CLOCK_TICKS_PER_US}};
+    struct itimerval Off = {{0, 0}, {0, 0}};
+    struct sigaction Action = {{0}};
+#endif
+
+    BOARD_Init();
+#ifdef USE_PREEMPTION
+    printf("ES_Run response time benchmark, %d services, preemptive\r\n",
+            NUM_SERVICES);
+#else
+    printf("ES_Run response time benchmark, %d services, cooperative\r\n",
+            NUM_SERVICES);
+#endif
+    if (ES_Initialize() != Success) {
+        return 1;
+    }
+#ifdef __PIC32MX__
+    OpenCoreTimer(PREEMPT_ISR_TICKS);
+    mConfigIntCoreTimer(CT_INT_ON | CT_INT_PRIOR_2);
+#else
+    // the software interrupt is held off while it runs, as it is below it
+    Action.sa_handler = PreemptSignalHandler;
+    HostInterruptSignals(&Action.sa_mask);
+    sigaction(HOST_TIMER_SIGNAL, &Action, NULL);
+    setitimer(ITIMER_REAL, &Interval, NULL);
+#endif
+    ES_Run();
+#ifdef __PIC32MX__
+    mConfigIntCoreTimer(CT_INT_OFF);
+#else
+    setitimer(ITIMER_REAL, &Off, NULL);
+#endif
+    printf("%u posts, response min %lu avg %lu max %lu ticks\r\n",
+            Samples, (unsigned long) MinLatency,
+            (unsigned long) (TotalLatency / Samples),
+            (unsigned long) MaxLatency);
+#ifdef __PIC32MX__
+    while (1);
+#else
+    return 0;
+#endif
+}
+#endif
 /*------------------------------ End of file ------------------------------*/
 
 /****************************************************************************
@@ -1125,13 +4429,18 @@ void ES_TattleTaleDump(void)
 {
     uint8_t curDataPoint = 0;
     tattleDepth = 0;
+    // hold the timers off while the trace prints
+#ifdef USE_TICKLESS_TIMERS
+    IEC0CLR = _IEC0_CTIE_MASK;
+#else
     T1CONCLR = _T1CON_ON_MASK;
+#endif
     for (curDataPoint = 0; curDataPoint < tattleCount; curDataPoint++) {
 #ifdef SUPPRESS_EXIT_ENTRY_IN_TATTLE
         if ((TattleData[curDataPoint].Event.EventType != ES_ENTRY) || (TattleData[curDataPoint].Event.EventType != ES_EXIT)) {
 #endif
-            printf("%s[%s(%s,%X)]", TattleData[curDataPoint].FunctionName, TattleData[curDataPoint].StateName,          \
-                        EventNames[TattleData[curDataPoint].Event.EventType], TattleData[curDataPoint].Event.EventParam);
+            printf("%s[%s(%s,%lX)]", TattleData[curDataPoint].FunctionName, TattleData[curDataPoint].StateName,          \
+                        EventNames[TattleData[curDataPoint].Event.EventType], (unsigned long) TattleData[curDataPoint].Event.EventParam);
             if (curDataPoint < (tattleCount - 1)) {
                 printf("->");
             } else {
@@ -1144,7 +4453,11 @@ void ES_TattleTaleDump(void)
     }
     printf("\n");
     tattleCount = 0;
+#ifdef USE_TICKLESS_TIMERS
+    IEC0SET = _IEC0_CTIE_MASK; // any timers that came due meanwhile go now
+#else
     T1CONSET = _T1CON_ON_MASK;
+#endif
 }
 
 /**
@@ -1208,7 +4521,8 @@ void ES_CheckTail(const char *FunctionName)
  Description
      source file for the module to call the User event checking routines
  Notes
-     Users should only modify the contents of the ES_EventList array.
+     the checkers and when to call them come from EVENT_CHECK_LIST in
+     ES_Configure.h
  History
  When           Who     What/Why
  -------------- ---     --------
@@ -1222,9 +4536,39 @@ void ES_CheckTail(const char *FunctionName)
 
 #include EVENT_CHECK_HEADER
 
-// Fill in this array with the names of your event checking functions
+#if NUM_EVENT_CHECKERS > 0
+typedef struct {
+    CheckFunc *CheckFunc;   // the event checker
+    CheckFunc *ReadyFunc;   // TRUE when it could find something
+    uint16_t Period;        // ms between calls, 0 for every pass
+} ES_CheckerDesc_t;
+
+typedef struct {
+    uint32_t LastCall;      // ES_Timer_GetTime of the last call
+    uint32_t Calls;
+    uint32_t Hits;
+} ES_CheckerCount_t;
+
+// each checker's Ready expression becomes a function for the table
+#define CHECKER_READY_FORM(FUNC, PERIOD, READY) \
+    static uint8_t FUNC##_IsReady(void) { return (READY) ? TRUE : FALSE; }
+EVENT_CHECK_LIST(CHECKER_READY_FORM)
+
+#define CHECKER_DESC_FORM(FUNC, PERIOD, READY) {FUNC, FUNC##_IsReady, PERIOD},
+static ES_CheckerDesc_t const ES_EventList[] = {
+    EVENT_CHECK_LIST(CHECKER_DESC_FORM)
+};
+
+#define CHECKER_NAME_FORM(FUNC, PERIOD, READY) #FUNC,
+static const char * const CheckerNames[] = {
+    EVENT_CHECK_LIST(CHECKER_NAME_FORM)
+};
 
-static CheckFunc * const ES_EventList[]={EVENT_CHECK_LIST };
+static ES_CheckerCount_t CheckerCounts[NUM_EVENT_CHECKERS];
+
+// where the next pass through the checkers starts
+static uint8_t NextChecker;
+#endif
 
 
 // Implementation for public functions
@@ -1237,24 +4581,105 @@ static CheckFunc * const ES_EventList[]={EVENT_CHECK_LIST };
  Returns
    TRUE if any of the user event checkers returned TRUE, FALSE otherwise
  Description
-   loop through the EF_EventList array executing the event checking functions
+   loop through the ES_EventList array executing the event checking functions
+   that are due and ready
  Notes
-   
+   stops at the first checker to find an event so that it is processed
+   first, and the next call starts with the checker after that one, so the
+   checkers late in the list get their turn too
  Author
    J. Edward Carryer, 10/25/11, 08:55
 ****************************************************************************/
 uint8_t ES_CheckUserEvents( void ) 
 {
+#if NUM_EVENT_CHECKERS > 0
   unsigned char i;
-  // loop through the array executing the event checking functions
+  uint8_t Which = NextChecker;
+  uint32_t Now = ES_Timer_GetTime();
+  ES_CheckerCount_t *pCount;
+
+  // go once around the list, starting where the last pass left off
   for ( i=0; i< ARRAY_SIZE(ES_EventList); i++) {
-    if ( ES_EventList[i]() == TRUE )
-      break; // found a new event, so process it first
+    pCount = &CheckerCounts[Which];
+    if ( (ES_EventList[Which].Period == 0) ||
+         ((Now - pCount->LastCall) >= ES_EventList[Which].Period) ) {
+      if ( ES_EventList[Which].ReadyFunc() == TRUE ) {
+        pCount->LastCall = Now;
+        pCount->Calls++;
+        if ( ES_EventList[Which].CheckFunc() == TRUE ) {
+          pCount->Hits++;
+          // found a new event, so process it first
+          NextChecker = (Which + 1 == ARRAY_SIZE(ES_EventList)) ? 0 : Which + 1;
+          return(TRUE);
+        }
+      }
+    }
+    if ( ++Which == ARRAY_SIZE(ES_EventList) )
+      Which = 0;
   }
-  if ( i == ARRAY_SIZE(ES_EventList) ) // if no new events
-    return (FALSE);
-  else
-    return(TRUE);
+#endif
+  return (FALSE);
+}
+
+/****************************************************************************
+ Function
+   ES_CheckerIdleTime
+ Parameters
+   None
+ Returns
+   uint32_t : 0 if a checker is due and ready now, otherwise milliseconds
+              until the next one's period is up, ES_NO_DEADLINE if none
+ Description
+   tells ES_Run how long it can idle before the checkers need a call
+ Notes
+   a checker whose period is up but whose Ready is false is waiting on an
+   interrupt, which wakes ES_Run anyway. A checker with no period and a
+   Ready of TRUE is always due, so ES_Run never idles.
+****************************************************************************/
+uint32_t ES_CheckerIdleTime( void )
+{
+  uint32_t Wait = ES_NO_DEADLINE;
+#if NUM_EVENT_CHECKERS > 0
+  unsigned char i;
+  uint32_t Now = ES_Timer_GetTime();
+  uint32_t Elapsed;
+
+  for ( i=0; i< ARRAY_SIZE(ES_EventList); i++) {
+    Elapsed = Now - CheckerCounts[i].LastCall;
+    if ( (ES_EventList[i].Period == 0) || (Elapsed >= ES_EventList[i].Period) ) {
+      if ( ES_EventList[i].ReadyFunc() == TRUE )
+        return(0);
+    } else if ( (ES_EventList[i].Period - Elapsed) < Wait ) {
+      Wait = ES_EventList[i].Period - Elapsed;
+    }
+  }
+#endif
+  return(Wait);
+}
+
+/****************************************************************************
+ Function
+   ES_GetCheckerStats
+ Parameters
+   uint8_t : which checker, its place in EVENT_CHECK_LIST
+   ES_CheckerStats_t * : where to put the counters
+ Returns
+   uint8_t : FALSE if WhichChecker is not in the list
+ Description
+   copies out the name and counters of one of the event checkers
+****************************************************************************/
+uint8_t ES_GetCheckerStats( uint8_t WhichChecker, ES_CheckerStats_t * pStats )
+{
+#if NUM_EVENT_CHECKERS > 0
+  if ( WhichChecker >= ARRAY_SIZE(ES_EventList) )
+    return(FALSE);
+  pStats->Name = CheckerNames[WhichChecker];
+  pStats->Calls = CheckerCounts[WhichChecker].Calls;
+  pStats->Hits = CheckerCounts[WhichChecker].Hits;
+  return(TRUE);
+#else
+  return(FALSE);
+#endif
 }
 /*------------------------------- Footnotes -------------------------------*/
 /*------------------------------ End of file ------------------------------*/
@@ -1302,8 +4727,6 @@ static enum {
 // with the introduction of Gen2, we need a module level Priority variable
 static uint8_t MyPriority;
 
-static ES_EventTyp_t UserTimerStates[TIMERS_USED];
-
 
 /*------------------------------ Module Code ------------------------------*/
 
@@ -1343,7 +4766,8 @@ uint8_t PostTimerService(ES_Event ThisEvent) {
  * @Function RunTimerService(ES_Event ThisEvent)
  * @param ES_Event - the event to process
  * @return ES_NO_EVENT or ES_ERROR 
- * @brief  accepts the timer events and updates the state arrays
+ * @brief  accepts the events of the timers it is given. Their state is read
+ * from the timers themselves, see GetUserTimerState, so nothing is kept here
  * @author Max Dunne   2013.01.04 */
 ES_Event RunTimerService(ES_Event ThisEvent) {
     ES_Event ReturnEvent;
@@ -1353,11 +4777,6 @@ ES_Event RunTimerService(ES_Event ThisEvent) {
     switch (ThisEvent.EventType) {
         case ES_INIT:
             break;
-        case ES_TIMEOUT:
-        case ES_TIMERACTIVE:
-        case ES_TIMERSTOPPED:
-            UserTimerStates[ThisEvent.EventParam] = ThisEvent.EventType;
-            break;
         default:
             //ReturnEvent.EventType = ES_ERROR;
             break;
@@ -1368,12 +4787,13 @@ ES_Event RunTimerService(ES_Event ThisEvent) {
         uint8_t i;
         switch (timerServiceTestingState) {
             case init:
+                // the timers were started before ES_Run, their states are
+                // read rather than waited for, so that the test runs with
+                // or without SUPPRESS_TIMER_STATE_EVENTS
                 if (ThisEvent.EventType == ES_INIT) {
                     printf("Timer Module INITED succesfully\r\n");
-                    break;
                 }
-                printf("Timer %d had event %d at time %d\r\n", ThisEvent.EventParam, ThisEvent.EventType, ES_Timer_GetTime());
-                if ((ThisEvent.EventParam == (TIMERS_USED - 1)) && (ThisEvent.EventType == ES_TIMERACTIVE)) {
+                if (IsUserTimerActive(TIMERS_USED - 1) == TRUE) {
                     timerServiceTestingState = expired;
                     printf("Testing timer user functions [expired][stopped][active]{state}\r\n");
                 }
@@ -1381,7 +4801,7 @@ ES_Event RunTimerService(ES_Event ThisEvent) {
 
             case expired:
                 for (i = 0; i < TIMERS_USED; i++) {
-                    printf("(%d):[%d,%d,%d]{%d} ", i, IsTimerExpired(i), IsTimerStopped(i), IsTimerActive(i), GetUserTimerState(i));
+                    printf("(%d):[%d,%d,%d]{%d} ", i, IsUserTimerExpired(i), IsUserTimerStopped(i), IsUserTimerActive(i), GetUserTimerState(i));
                 }
                 printf("\r\n");
                 if ((ThisEvent.EventParam == (TIMERS_USED - 1)) && (ThisEvent.EventType == ES_TIMEOUT)) {
@@ -1400,9 +4820,9 @@ ES_Event RunTimerService(ES_Event ThisEvent) {
                     for (i = 1; i < TIMERS_USED; i++) {
                         ES_Timer_StopTimer(i);
                     }
-                }
-                if ((ThisEvent.EventParam == (TIMERS_USED - 1)) && (ThisEvent.EventType == ES_TIMERSTOPPED)) {
-                    printf("Testing of User Timer Functions is complete.\r\n");
+                    if (IsUserTimerStopped(TIMERS_USED - 1) == TRUE) {
+                        printf("Testing of User Timer Functions is complete.\r\n");
+                    }
                 }
 
                 break;
@@ -1418,16 +4838,16 @@ ES_Event RunTimerService(ES_Event ThisEvent) {
 }
 
 /**
- * @Function IsTimerExpired(unsigned char Num)
+ * @Function IsUserTimerExpired(unsigned char Num)
  * @param Num - the number of the timer to check
  * @return ERROR or TRUE or FALSE 
  * @brief  used to determine if a timer is currently expired.
  * @author Max Dunne   2013.01.04 */
-int8_t IsTimerExpired(unsigned char Num) {
+int8_t IsUserTimerExpired(unsigned char Num) {
     if (Num >= TIMERS_USED) {
         return ERROR;
     }
-    if (UserTimerStates[Num] == ES_TIMEOUT) {
+    if (ES_Timer_GetTimerState(Num) == ES_TIMEOUT) {
         return TRUE;
     } else {
         return FALSE;
@@ -1435,16 +4855,16 @@ int8_t IsTimerExpired(unsigned char Num) {
 }
 
 /**
- * @Function IsTimerActive(unsigned char Num)
+ * @Function IsUserTimerActive(unsigned char Num)
  * @param Num - the number of the timer to check
  * @return ERROR or TRUE or FALSE
  * @brief  used to determine if a timer is currently active.
  * @author Max Dunne   2013.01.04 */
-int8_t IsTimerActive(unsigned char Num) {
+int8_t IsUserTimerActive(unsigned char Num) {
     if (Num >= TIMERS_USED) {
         return ERROR;
     }
-    if (UserTimerStates[Num] == ES_TIMERACTIVE) {
+    if (ES_Timer_GetTimerState(Num) == ES_TIMERACTIVE) {
         return TRUE;
     } else {
         return FALSE;
@@ -1452,16 +4872,16 @@ int8_t IsTimerActive(unsigned char Num) {
 }
 
 /**
- * @Function IsTimerStopped(unsigned char Num)
+ * @Function IsUserTimerStopped(unsigned char Num)
  * @param Num - the number of the timer to check
  * @return ERROR or TRUE or FALSE
  * @brief  used to determine if a timer is currently stopped.
  * @author Max Dunne   2013.01.04 */
-int8_t IsTimerStopped(unsigned char Num) {
+int8_t IsUserTimerStopped(unsigned char Num) {
     if (Num >= TIMERS_USED) {
         return ERROR;
     }
-    if (UserTimerStates[Num] == ES_TIMERSTOPPED) {
+    if (ES_Timer_GetTimerState(Num) == ES_TIMERSTOPPED) {
         return TRUE;
     } else {
         return FALSE;
@@ -1478,7 +4898,7 @@ ES_EventTyp_t GetUserTimerState(unsigned char Num) {
     if (Num >= TIMERS_USED) {
         return ERROR;
     }
-    return UserTimerStates[Num];
+    return ES_Timer_GetTimerState(Num);
 }
 
 /***************************************************************************
@@ -1651,6 +5071,14 @@ static uint8_t MyPriority;
 
 static char CommandString[COMMANDSTRINGLENGTH] = {0};
 
+#ifdef USE_KEYBOARD_INPUT
+// names of the services for KeyboardInput_PrintQueues, taken from SERVICE_LIST
+#define SERVICE_NAME_FORM(INIT, RUN, POST, QUEUE_SIZE, BATCH, BUDGET) #RUN,
+static const char * const ServiceNames[] = {
+    SERVICE_LIST(SERVICE_NAME_FORM)
+};
+#endif
+
 /**
  * @Function InitKeyboardInput(uint8_t Priority)
  * @param Priority - internal variable to track which event queue to use
@@ -1700,6 +5128,7 @@ ES_Event RunKeyboardInput(ES_Event ThisEvent)
     ES_Event GeneratedEvent;
     uint8_t stringPos = 0;
     uint8_t numbersParsed = 0;
+    unsigned int EventNum, EventParam = 0;
     static uint8_t curCommandLength = 0;
     GeneratedEvent.EventType = ES_NO_EVENT;
     GeneratedEvent.EventParam = 0;
@@ -1718,8 +5147,16 @@ ES_Event RunKeyboardInput(ES_Event ThisEvent)
         printf("Keyboard input is active,\
              no other events except timer activations will be processed. \
                 You can redisplay the event list by sending a %d event.\r\n \
+                Send a %d event to see how full the service queues get.\r\n \
                 Send an event using the form [event#]; \
-                or [event#]->[EventParam];", ES_LISTEVENTS);
+                or [event#]->[EventParam];", ES_LISTEVENTS, ES_LISTQUEUES);
+        break;
+
+    case ES_OVERRUN:
+        // posted here if RUN_OVERRUN_POST_FUNC is PostKeyboardInput
+        if (ThisEvent.EventParam < NUM_SERVICES) {
+            printf("\n%s went over its run budget\n", ServiceNames[ThisEvent.EventParam]);
+        }
         break;
 
     case ES_KEYINPUT:
@@ -1727,21 +5164,27 @@ ES_Event RunKeyboardInput(ES_Event ThisEvent)
             CommandString[curCommandLength] = (char) ThisEvent.EventParam;
             curCommandLength++;
             if (ThisEvent.EventParam == TERMINATION_CHARACTER) {
-                numbersParsed = sscanf(CommandString, "%d -> %X", &GeneratedEvent.EventType, &GeneratedEvent.EventParam);
+                // scan into full size ints, the event fields are narrower
+                numbersParsed = sscanf(CommandString, "%u -> %X", &EventNum, &EventParam);
                 if (numbersParsed != 0) {
 
-                    if (GeneratedEvent.EventType < NUMBEROFEVENTS) {
+                    if (EventNum < NUMBEROFEVENTS) {
+                        GeneratedEvent.EventType = EventNum;
+                        GeneratedEvent.EventParam = EventParam;
                         switch (GeneratedEvent.EventType) {
                         case ES_LISTEVENTS:
                             KeyboardInput_PrintEvents();
                             break;
+                        case ES_LISTQUEUES:
+                            KeyboardInput_PrintQueues();
+                            break;
                         default:
-                            printf("\n\n%s with parameter %X was passed to %s\n", EventNames[GeneratedEvent.EventType], GeneratedEvent.EventParam, STRINGIFY(POSTFUNCTION_FOR_KEYBOARD_INPUT));
+                            printf("\n\n%s with parameter %lX was passed to %s\n", EventNames[GeneratedEvent.EventType], (unsigned long) GeneratedEvent.EventParam, STRINGIFY(POSTFUNCTION_FOR_KEYBOARD_INPUT));
                             POSTFUNCTION_FOR_KEYBOARD_INPUT(GeneratedEvent);
                             break;
                         }
                     } else {
-                        printf("Event #%d is Invalid, Please try again\n", GeneratedEvent.EventType);
+                        printf("Event #%u is Invalid, Please try again\n", EventNum);
                     }
                 }
                 for (stringPos = 0; stringPos < COMMANDSTRINGLENGTH; stringPos++) {
@@ -1783,3 +5226,88 @@ void KeyboardInput_PrintEvents(void)
 #endif
 }
 
+/**
+ * @Function KeyboardInput_PrintQueues(void)
+ * @param None
+ * @return None
+ * @brief  Lists the queue counters of every service, see ES_GetQueueStats,
+ *         their run function times, see ES_GetRunStats, and the event
+ *         checker counters, see ES_GetCheckerStats. */
+void KeyboardInput_PrintQueues(void)
+{
+#ifdef USE_KEYBOARD_INPUT
+    uint8_t curService;
+    ES_QueueStats_t Stats;
+    printf("Queue counters for each service, by priority\n");
+    printf("Pri %-25s Depth Peak Size  Dropped Coalesced     Posted\n", "Service");
+    for (curService = 0; curService < NUM_SERVICES; curService++) {
+        ES_GetQueueStats(curService, &Stats);
+        printf("%3d %-25s %5d %4d %4d %8u %9u %10lu\n", curService,
+                ServiceNames[curService], Stats.Depth, Stats.Peak,
+                Stats.Capacity, Stats.Dropped, Stats.Coalesced,
+                (unsigned long) Stats.Posted);
+    }
+    printf("Multicasts refused: %u\n", ES_GetMulticastFailures());
+#ifdef USE_ISR_POST_RING
+    printf("Interrupt posts refused: %u\n", ES_GetIsrPostsDropped());
+#endif
+#ifdef USE_IDLE_WAIT
+    {
+        ES_IdleStats_t Idle;
+        ES_GetIdleStats(&Idle);
+        printf("Idle: %lu sleeps, %lu woken by a post, wake up %lu ns average %lu ns worst\n",
+                (unsigned long) Idle.Sleeps, (unsigned long) Idle.Wakes,
+                (unsigned long) Idle.AverageWake * (1000 / ES_RUN_CLOCK_TICKS_PER_US),
+                (unsigned long) Idle.WorstWake * (1000 / ES_RUN_CLOCK_TICKS_PER_US));
+    }
+#endif
+#ifdef USE_RUN_BUDGETS
+    {
+        ES_RunStats_t RunStats;
+        printf("Run function times in microseconds, by priority\n");
+        printf("Pri %-25s Budget    Worst  Overruns       Runs\n", "Service");
+        for (curService = 0; curService < NUM_SERVICES; curService++) {
+            ES_GetRunStats(curService, &RunStats);
+            printf("%3d %-25s %6lu %8lu %9lu %10lu\n", curService,
+                    ServiceNames[curService], (unsigned long) RunStats.Budget,
+                    (unsigned long) RunStats.Worst,
+                    (unsigned long) RunStats.Overruns,
+                    (unsigned long) RunStats.Runs);
+        }
+    }
+#endif
+#ifdef USE_TIMER_STATS
+    {
+        uint16_t curTimer;
+        ES_TimerStats_t Timer;
+        printf("Timers that have timed out, lateness in microseconds\n");
+        printf("Num   Period   Timeouts    Handled  Skipped    Stale  WorstLate\n");
+        for (curTimer = 0; curTimer < NUM_TIMERS; curTimer++) {
+            ES_Timer_GetStats(curTimer, &Timer);
+            if (Timer.Timeouts != 0) {
+                printf("%3u %8lu %10lu %10lu %8lu %8lu %10lu\n", curTimer,
+                        (unsigned long) Timer.Period,
+                        (unsigned long) Timer.Timeouts,
+                        (unsigned long) Timer.Handled,
+                        (unsigned long) Timer.Skipped,
+                        (unsigned long) Timer.Stale,
+                        (unsigned long) Timer.WorstLate);
+            }
+        }
+    }
+#endif
+    {
+        uint8_t curChecker;
+        ES_CheckerStats_t CheckerStats;
+        printf("Event checkers\n");
+        printf("    %-25s      Calls       Hits\n", "Checker");
+        for (curChecker = 0; curChecker < NUM_EVENT_CHECKERS; curChecker++) {
+            ES_GetCheckerStats(curChecker, &CheckerStats);
+            printf("    %-25s %10lu %10lu\n", CheckerStats.Name,
+                    (unsigned long) CheckerStats.Calls,
+                    (unsigned long) CheckerStats.Hits);
+        }
+    }
+#endif
+}
+
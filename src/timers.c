@@ -7,7 +7,8 @@
 
 #include <xc.h>
 #include <BOARD.h>
-#include <peripheral/timer.h>
+#include "ES_Configure.h"
+#include "ES_Framework.h"
 #include "timers.h"
 
 
@@ -15,19 +16,16 @@
  * PRIVATE #DEFINES                                                            *
  ******************************************************************************/
  //#define TIMERS_TEST
- 
-#define F_PB (BOARD_GetPBClock())
-#define TIMER_FREQUENCY 1000
-//Change to alter number of used timers with a max of 32
-#define NUM_TIMERS 16
+
+//Change to alter number of used timers, each one takes an ES timer
+#define NUM_POLLED_TIMERS 16
 
 /*******************************************************************************
  * PRIVATE VARIABLES                                                           *
  ******************************************************************************/
-static unsigned int Timer_Array[NUM_TIMERS];
-static unsigned int TimerActiveFlags;
-static unsigned int TimerEventFlags;
-static unsigned int FreeRunningTimer;
+// the ES timer behind each polled timer, ES_TIMER_NO_HANDLE until TIMERS_Init
+static uint8_t Handle[NUM_POLLED_TIMERS];
+static uint8_t HandlesTaken;
 
 
 /*******************************************************************************
@@ -38,17 +36,25 @@ static unsigned int FreeRunningTimer;
  * @Function TIMERS_Init(void)
  * @param none
  * @return None.
- * @brief  Initializes the timer module
+ * @brief  Initializes the timer module. The timers are ES timers handed out by
+ * ES_Timer_Alloc that post nothing, so they share the framework timer
+ * interrupt rather than having one of their own.
  * @author Max Dunne, 2011.11.15 */
 void TIMERS_Init(void) {
-    TimerActiveFlags = 0;
-    TimerEventFlags = 0;
-    FreeRunningTimer = 0;
-    OpenTimer5(T5_ON | T5_SOURCE_INT | T5_PS_1_1, F_PB / TIMER_FREQUENCY);
-    INTClearFlag(INT_T5);
-    INTSetVectorPriority(INT_TIMER_5_VECTOR,3);
-    INTSetVectorSubPriority(INT_TIMER_5_VECTOR,3);
-    INTEnable(INT_T5,INT_ENABLED);
+    uint8_t i;
+    ES_Timer_Init();
+    if (!HandlesTaken) {
+        HandlesTaken = TRUE;
+        for (i = 0; i < NUM_POLLED_TIMERS; i++) {
+            Handle[i] = ES_Timer_Alloc(ES_Timer_NoPost);
+        }
+    }
+    for (i = 0; i < NUM_POLLED_TIMERS; i++) {
+        if (Handle[i] != ES_TIMER_NO_HANDLE) {
+            ES_Timer_StopTimer(Handle[i]);
+            ES_Timer_ClearTimerExpired(Handle[i]);
+        }
+    }
 }
 
 /**
@@ -59,9 +65,10 @@ void TIMERS_Init(void) {
  * @brief  sets the time for a timer, but does not make it active.
  * @author Max Dunne  2011.11.15 */
 char SetTimer(unsigned char Num, unsigned int NewTime) {
-    if (Num >= NUM_TIMERS)
+    if ((Num >= NUM_POLLED_TIMERS) || (Handle[Num] == ES_TIMER_NO_HANDLE))
+        return ERROR;
+    if (ES_Timer_SetTimer(Handle[Num], NewTime) == ES_Timer_ERR)
         return ERROR;
-    Timer_Array[Num] = NewTime;
     return SUCCESS;
 }
 
@@ -72,9 +79,10 @@ char SetTimer(unsigned char Num, unsigned int NewTime) {
  * @brief  simply sets the active flag in TMR_ActiveFlags to resart a stopped timer.
  * @author Max Dunne, 2011.11.15 */
 char StartTimer(unsigned char Num) {
-    if (Num >= NUM_TIMERS)
+    if ((Num >= NUM_POLLED_TIMERS) || (Handle[Num] == ES_TIMER_NO_HANDLE))
+        return ERROR;
+    if (ES_Timer_StartTimer(Handle[Num]) == ES_Timer_ERR)
         return ERROR;
-    TimerActiveFlags |= (1 << Num);
     return SUCCESS;
 }
 
@@ -86,9 +94,9 @@ char StartTimer(unsigned char Num) {
  * will cause it to stop counting.
  * @author Max Dunne 2011.11.15 */
 char StopTimer(unsigned char Num) {
-    if (Num >= NUM_TIMERS)
+    if ((Num >= NUM_POLLED_TIMERS) || (Handle[Num] == ES_TIMER_NO_HANDLE))
         return ERROR;
-    TimerActiveFlags &= ~(1 << Num);
+    ES_Timer_StopTimer(Handle[Num]); // stopping a stopped timer is no error here
     return SUCCESS;
 }
 
@@ -101,11 +109,10 @@ char StopTimer(unsigned char Num) {
  * and sets the timer actice to begin counting.
  * @author Max Dunne 2011.11.15 */
 char InitTimer(unsigned char Num, unsigned int NewTime) {
-    if (Num >= NUM_TIMERS)
+    if ((Num >= NUM_POLLED_TIMERS) || (Handle[Num] == ES_TIMER_NO_HANDLE))
+        return ERROR;
+    if (ES_Timer_InitTimer(Handle[Num], NewTime) == ES_Timer_ERR)
         return ERROR;
-    Timer_Array[Num] = NewTime;
-    TimerEventFlags &= ~(1 << Num);
-    TimerActiveFlags |= (1 << Num);
     return SUCCESS;
 }
 
@@ -116,9 +123,9 @@ char InitTimer(unsigned char Num, unsigned int NewTime) {
  * @brief  used to determine if a timer is currently counting.
  * @author Max Dunne   2011.11.15 */
 char IsTimerActive(unsigned char Num) {
-    if (Num >= NUM_TIMERS)
+    if ((Num >= NUM_POLLED_TIMERS) || (Handle[Num] == ES_TIMER_NO_HANDLE))
         return ERROR;
-    if ((TimerActiveFlags & (1 << Num)) != 0) {
+    if (ES_Timer_IsTimerActive(Handle[Num]) == ES_Timer_ACTIVE) {
         return TIMER_ACTIVE;
     } else {
         return TIMER_NOT_ACTIVE;
@@ -132,9 +139,9 @@ char IsTimerActive(unsigned char Num) {
  * @brief  used to determine if a timer is currently expired.
  * @author Max Dunne   2011.11.15 */
 char IsTimerExpired(unsigned char Num) {
-    if (Num >= NUM_TIMERS)
+    if ((Num >= NUM_POLLED_TIMERS) || (Handle[Num] == ES_TIMER_NO_HANDLE))
         return ERROR;
-    if ((TimerEventFlags & (1 << Num)) != 0) {
+    if (ES_Timer_IsTimerExpired(Handle[Num]) == ES_Timer_EXPIRED) {
         return TIMER_EXPIRED;
     } else {
         return TIMER_NOT_EXPIRED;
@@ -149,57 +156,28 @@ char IsTimerExpired(unsigned char Num) {
  * has been serviced.
  * @author Max Dunne  211.11.15 */
 char ClearTimerExpired(unsigned char Num) {
-    if (Num >= NUM_TIMERS)
+    if ((Num >= NUM_POLLED_TIMERS) || (Handle[Num] == ES_TIMER_NO_HANDLE))
         return ERROR;
-    TimerEventFlags &= ~(1 << Num);
+    ES_Timer_ClearTimerExpired(Handle[Num]);
     return SUCCESS;
 }
 
 /**
  * Function: GetTime
  * @param None
- * @return FreeRunningTimer, the current value of the module variable FreeRunningTimer
+ * @return the current value of the ES free running timer in ms
  * @remark Provides the ability to grab a snapshot time as an alternative to using
  * the library timers. Can be used to determine how long between 2 events.
  * @author Max Dunne 2011.11.15  */
 unsigned int GetTime(void) {
-    return FreeRunningTimer;
+    return ES_Timer_GetTime();
 }
 
-/**
- * @Function Timer5IntHandler(void)
- * @param None.
- * @return None.
- * @brief  This is the interrupt handler to support the timer module. It will increment 
- * time, to maintain the functionality of the GetTime() timer and it will check 
- * through the active timers, decrementing each active timers count, if the 
- * count goes to 0, it will set the associated event flag and clear the active 
- * flag to prevent further counting.
- * @author Max Dunne 2011.11.15 */
-
-void __ISR(_TIMER_5_VECTOR, ipl3auto) Timer5IntHandler(void) {
-    INTClearFlag(INT_T5);
-    FreeRunningTimer++;
-    char CurTimer = 0;
-    if (TimerActiveFlags != 0) {
-        for (CurTimer = 0; CurTimer < NUM_TIMERS; CurTimer++) {
-            if ((TimerActiveFlags & (1 << CurTimer)) != 0) {
-                if (--Timer_Array[CurTimer] == 0) {
-                    TimerEventFlags |= (1 << CurTimer);
-                    TimerActiveFlags &= ~(1 << CurTimer);
-                }
-            }
-        }
-    }
-}
-
-
-
 
 #ifdef TIMERS_TEST
     #include "serial.h"
     #include "timers.h"
-    #define TIMERS_IN_TEST NUM_TIMERS
+    #define TIMERS_IN_TEST NUM_POLLED_TIMERS
 //#include <plib.h>
 
 int main(void) {